@@ -12,6 +12,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <dirent.h>
 #include <sys/stat.h>
 #ifdef HAVE_CONFIG_H
 #	include "config.h"
@@ -41,8 +42,9 @@ static void             parse_command_line(int argc, char **argv);
 static void             show_usage();
 static void             mutt_query(char *str);
 static void             init_mutt_query();
-static void		convert(char *srcformat, char *srcfile,
-				char *dstformat, char *dstfile);
+static void		convert(char *srcformat, abook_list *srcfiles,
+				char *dstformat, char *dstfile,
+				char *outfields, abook_list *conditions);
 static void		add_email(int);
 static void		set_email_fields(char *fl);
 
@@ -304,7 +306,10 @@ parse_command_line(int argc, char **argv)
 	char *informat = "abook",
 		*outformat = "text",
 		*infile = "-",
-		*outfile = "-";
+		*outfile = "-",
+		*outfields = NULL,
+		*condition = NULL;
+	abook_list *infiles = NULL, *conditions = NULL;
 	int c;
 	selected_item_filter = select_output_item_filter("muttq");
 
@@ -321,6 +326,8 @@ parse_command_line(int argc, char **argv)
 			OPT_OUTFORMAT_STR,
 			OPT_INFILE,
 			OPT_OUTFILE,
+			OPT_OUTFIELDS,
+			OPT_WHERE,
 			OPT_FORMATS
 		};
 		static struct option long_options[] = {
@@ -337,6 +344,8 @@ parse_command_line(int argc, char **argv)
 			{ "outformatstr", 1, 0, OPT_OUTFORMAT_STR },
 			{ "infile", 1, 0, OPT_INFILE },
 			{ "outfile", 1, 0, OPT_OUTFILE },
+			{ "outfields", 1, 0, OPT_OUTFIELDS },
+			{ "where", 1, 0, OPT_WHERE },
 			{ "formats", 0, 0, OPT_FORMATS },
 			{ 0, 0, 0, 0 }
 		};
@@ -397,10 +406,18 @@ parse_command_line(int argc, char **argv)
 				break;
 			case OPT_INFILE:
 				set_convert_var(infile);
+				abook_list_append(&infiles, infile);
 				break;
 			case OPT_OUTFILE:
 				set_convert_var(outfile);
 				break;
+			case OPT_OUTFIELDS:
+				set_convert_var(outfields);
+				break;
+			case OPT_WHERE:
+				set_convert_var(condition);
+				abook_list_append(&conditions, condition);
+				break;
 			case OPT_FORMATS:
 				print_filters();
 				exit(EXIT_SUCCESS);
@@ -437,7 +454,10 @@ parse_command_line(int argc, char **argv)
 		case MODE_QUERY:
 			mutt_query(query_string);
 		case MODE_CONVERT:
-			convert(informat, infile, outformat, outfile);
+			if(!infiles)
+				abook_list_append(&infiles, infile);
+			convert(informat, infiles, outformat, outfile,
+					outfields, conditions);
 	}
 }
 
@@ -464,12 +484,17 @@ show_usage()
 	puts	(_("					(default: abook)"));
 	puts	(_("	--infile	<file>		source file"));
 	puts	(_("					(default: stdin)"));
+	puts	(_("					can be repeated, or be a directory"));
 	puts	(_("	--outformat	<format>	format for output file"));
 	puts	(_("					(default: text)"));
 	puts	(_("	--outfile	<file>		destination file"));
 	puts	(_("					(default: stdout)"));
 	puts	(_("	--outformatstr	<str>   	format to use for \"custom\" --outformat"));
 	puts	(_("					(default: \"{nick} ({name}): {mobile}\")"));
+	puts	(_("	--outfields	<fields>	comma separated fields to export"));
+	puts	(_("	--where		<condition>	only export the matching entries,"));
+	puts	(_("					field, field=value or field~value,"));
+	puts	(_("					can be repeated"));
 	puts	(_("	--formats			list available formats"));
 }
 
@@ -493,7 +518,7 @@ mutt_query(char *str)
 	init_mutt_query();
 
 	if( str == NULL || !strcasecmp(str, "all") ) {
-		export_file("muttq", "-");
+		export_file("muttq", "-", ENUM_ALL);
 	} else {
 		int search_fields[] = {NAME, EMAIL, NICK, -1};
 		int i;
@@ -644,12 +669,114 @@ abook_fopen (const char *path, const char *mode)
 			NULL : fopen(path, mode);
 }
 
+static int
+strptrcmp(const void *a, const void *b)
+{
+	return strcmp(*(char **)a, *(char **)b);
+}
+
+/*
+ * Appends the regular files of the directory dir to list, sorted by name
+ * so that imports from a directory are deterministic.
+ */
+static int
+add_directory_files(abook_list **list, char *dir)
+{
+	DIR *d;
+	struct dirent *ent;
+	struct stat s;
+	char **names = NULL, *path;
+	int i, n = 0;
+
+	if((d = opendir(dir)) == NULL)
+		return -1;
+
+	while((ent = readdir(d)) != NULL) {
+		if(*ent->d_name == '.')
+			continue;
+
+		path = strconcat(dir, "/", ent->d_name, NULL);
+		if(stat(path, &s) == -1 || !S_ISREG(s.st_mode)) {
+			free(path);
+			continue;
+		}
+
+		names = xrealloc(names, sizeof(char *) * (n + 1));
+		names[n++] = path;
+	}
+	closedir(d);
+
+	qsort(names, n, sizeof(char *), strptrcmp);
+
+	for(i = 0; i < n; i++) {
+		abook_list_append(list, names[i]);
+		free(names[i]);
+	}
+	free(names);
+
+	return n;
+}
+
+static abook_list *
+expand_input_files(abook_list *files)
+{
+	abook_list *res = NULL;
+	struct stat s;
+
+	for(; files; files = files->next) {
+		if(strcmp(files->data, "-") && stat(files->data, &s) != -1 &&
+				S_ISDIR(s.st_mode)) {
+			if(add_directory_files(&res, files->data) < 0)
+				fprintf(stderr, _("cannot read directory %s\n"),
+						files->data);
+		} else
+			abook_list_append(&res, files->data);
+	}
+
+	return res;
+}
+
 static void
-convert(char *srcformat, char *srcfile, char *dstformat, char *dstfile)
+set_export_filter(char *outfields, abook_list *conditions)
+{
+	abook_list *keys, *cur;
+	int *ids, n = 0;
+	char *err;
+
+	if(outfields) {
+		keys = csv_to_abook_list(outfields);
+		for(cur = keys; cur; cur = cur->next)
+			n++;
+		ids = xmalloc(sizeof(int) * max(n, 1));
+		for(cur = keys, n = 0; cur; cur = cur->next, n++)
+			if(!find_field_number(cur->data, &ids[n])) {
+				fprintf(stderr, _("unknown field %s\n"),
+						cur->data);
+				exit(EXIT_FAILURE);
+			}
+		db_set_projection(ids, n);
+		free(ids);
+		abook_list_free(&keys);
+	}
+
+	for(cur = conditions; cur; cur = cur->next)
+		if((err = db_add_condition(cur->data))) {
+			fprintf(stderr, _("invalid condition %s: %s\n"),
+					cur->data, err);
+			exit(EXIT_FAILURE);
+		}
+	abook_list_free(&conditions);
+}
+
+static void
+convert(char *srcformat, abook_list *srcfiles, char *dstformat, char *dstfile,
+		char *outfields, abook_list *conditions)
 {
 	int ret=0;
+	int streamed = -1;
+	abook_list *files;
 
-	if( !srcformat || !srcfile || !dstformat || !dstfile ) {
+	if( !srcformat || !srcfiles || !dstformat || !dstfile ) {
 		fprintf(stderr, _("too few arguments to make conversion\n"));
 		fprintf(stderr, _("try --help\n"));
 	}
@@ -666,21 +793,65 @@ convert(char *srcformat, char *srcfile, char *dstformat, char *dstfile)
 	init_opts();
 	load_opts(rcfile);
 	init_standard_fields();
+	set_export_filter(outfields, conditions);
 
-	switch(import_file(srcformat, srcfile)) {
-		case -1:
-			fprintf(stderr,
-				_("input format %s not supported\n"), srcformat);
-			ret = 1;
-			break;
-		case 1:
-			fprintf(stderr, _("cannot read file %s\n"), srcfile);
-			ret = 1;
-			break;
+	files = expand_input_files(srcfiles);
+	abook_list_free(&srcfiles);
+
+	/* the render cache is kept next to a single input file */
+	export_cache_source(files && !files->next &&
+			strcmp(files->data, "-") ? files->data : NULL);
+
+	if(!files) {
+		fprintf(stderr, _("no input file\n"));
+		ret = 1;
+	} else if(!files->next && (streamed = convert_stream(srcformat,
+				files->data, dstformat, dstfile)) != -1) {
+		switch(streamed) {
+			case 1:
+				fprintf(stderr, _("cannot read file %s\n"),
+						files->data);
+				ret = 1;
+				break;
+			case 2:
+				fprintf(stderr,
+					_("cannot write file %s\n"), dstfile);
+				ret = 1;
+				break;
+		}
+	} else if(!files->next) {
+		switch(import_file(srcformat, files->data)) {
+			case -1:
+				fprintf(stderr,
+					_("input format %s not supported\n"),
+					srcformat);
+				ret = 1;
+				break;
+			case 1:
+				fprintf(stderr, _("cannot read file %s\n"),
+						files->data);
+				ret = 1;
+				break;
+		}
+	} else {
+		switch(import_files(srcformat, files)) {
+			case -1:
+				fprintf(stderr,
+					_("input format %s not supported\n"),
+					srcformat);
+				ret = 1;
+				break;
+			case 0:
+				break;
+			default: /* failures are reported per file */
+				ret = 1;
+		}
 	}
 
-	if(!ret)
-		switch(export_file(dstformat, dstfile)) {
+	abook_list_free(&files);
+
+	if(!ret && streamed == -1)
+		switch(export_file(dstformat, dstfile, ENUM_WHERE)) {
 			case -1:
 				fprintf(stderr,
 					_("output format %s not supported\n"),
@@ -790,8 +961,7 @@ add_email_add_item(int quiet, char *name, char *email)
 	item = item_create();
 	item_fput(item, NAME, xstrdup(name));
 	item_fput(item, EMAIL, xstrdup(email));
-	add_item2database(item);
-	item_free(&item);
+	db_adopt_item(item);
 
 	return 1;
 }
@@ -9,6 +9,8 @@
 #include <sys/types.h>
 #include "abook.h"
 #include "abook_rl.h"
+#include "database.h"
+#include "xmalloc.h"
 
 #ifdef HAVE_CONFIG_H
 #	include "config.h"
@@ -43,6 +45,12 @@ static WINDOW *rl_win;
 
 static bool rl_cancelled;
 
+/* called with the line whenever readline redisplays it */
+static void (*rl_line_hook)(char *line) = NULL;
+
+/* the fields whose values complete the line, see db_complete() */
+static int *rl_complete_fields = NULL;
+
 static void
 rl_refresh()
 {
@@ -67,6 +75,9 @@ rline_update()
 	int real_point = rl_point + rl_x;
 #endif
 
+	if(rl_line_hook)
+		rl_line_hook(rl_line_buffer);
+
 	if(real_point > (COLS - 1))
 		mvwaddnstr(rl_win, rl_y, rl_x,
 			rl_line_buffer + (1 + real_point - COLS),
@@ -86,6 +97,29 @@ rline_compdisp(char **matches, int n, int max_len)
 	/* dummy */
 }
 
+static char *
+rline_complete_value(const char *text, int state)
+{
+	static int pos;
+	char *s;
+
+	if(!state)
+		pos = -1;
+
+	s = db_complete(text, rl_complete_fields, &pos);
+
+	return s ? xstrdup(s) : NULL;
+}
+
+static char **
+rline_complete(const char *text, int start, int end)
+{
+	rl_attempted_completion_over = 1;
+	rl_completion_append_character = '\0';
+
+	return rl_completion_matches(text, rline_complete_value);
+}
+
 static void
 rline_prep_terminal(int dummy)
 {
@@ -142,6 +176,12 @@ abook_rl_init(bool use_completion)
 
 	rl_redisplay_function = rline_update;
 	rl_completion_display_matches_hook = rline_compdisp;
+	/* the values are completed as a whole, spaces included */
+	rl_attempted_completion_function =
+		rl_complete_fields ? rline_complete : NULL;
+	/* readline only sets its default once, so it is put back here */
+	rl_completer_word_break_characters = rl_complete_fields ? "" :
+		rl_basic_word_break_characters;
 	rl_prep_term_function = rline_prep_terminal;
 	rl_deprep_term_function = rline_deprep_terminal;
 
@@ -149,7 +189,7 @@ abook_rl_init(bool use_completion)
 	rl_unbind_function_in_map(rl_reverse_search_history, rl_get_keymap());
 	rl_unbind_function_in_map(rl_re_read_init_file, rl_get_keymap());
 
-	if(use_completion) {
+	if(use_completion || rl_complete_fields) {
 		rl_bind_key('\t', rl_menu_complete);
 	} else {
 		rl_unbind_function_in_map(rl_complete, rl_get_keymap());
@@ -186,3 +226,23 @@ abook_readline(WINDOW *w, int y, int x, char *s, bool use_completion)
 	return ret;
 }
 
+/*
+ * like abook_readline(), completing with the values of the fields of
+ * complete_fields and passing the line to hook on every redisplay,
+ * either of them may be NULL
+ */
+char *
+abook_readline_hook(WINDOW *w, int y, int x, char *s,
+		int complete_fields[], void (*hook)(char *line))
+{
+	char *ret;
+
+	rl_complete_fields = complete_fields;
+	rl_line_hook = hook;
+	ret = abook_readline(w, y, x, s, FALSE);
+	rl_line_hook = NULL;
+	rl_complete_fields = NULL;
+
+	return ret;
+}
+
@@ -5,5 +5,7 @@
 
 char		*abook_readline(WINDOW *w, int y, int x, char *s,
 		bool use_completion);
+char		*abook_readline_hook(WINDOW *w, int y, int x, char *s,
+		int complete_fields[], void (*hook)(char *line));
 
 #endif
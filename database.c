@@ -5,16 +5,23 @@
  * Copyright (C) Jaakko Heinonen
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <assert.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #ifdef HAVE_CONFIG_H
 #	include "config.h"
 #endif
 #include "abook.h"
 #include "database.h"
+#include "filter.h"
 #include "gettext.h"
 #include "list.h"
 #include "misc.h"
@@ -32,6 +39,154 @@ static int items = 0;
 #define INITIAL_LIST_CAPACITY	30
 static int list_capacity = 0;
 
+/*
+ * fields written by the exporters, all of them when projection is NULL
+ * (see db_set_projection())
+ */
+static int *projection = NULL;
+static int projection_count = 0;
+static char *projection_mask = NULL;
+static int projection_mask_size = 0;
+
+#define field_shown(id) \
+	(!projection_mask || ((id) < projection_mask_size && \
+		projection_mask[id]))
+
+/*
+ * Where load_database() found each item in the datafile, or where
+ * save_database() last wrote it, so that saving can copy the items that
+ * did not change from the previous datafile. An item is dirty, with a
+ * zero len, as soon as its text may differ from what write_database()
+ * writes for it.
+ */
+struct db_section {
+	off_t off;	/* of the "[n]" line */
+	size_t len;
+	int header;	/* length of the "[n]" line */
+	int n;		/* -1 if the line is not exactly "[n]" */
+	int saved;	/* 1 + position of the item in the running save,
+			   0 if it changed since */
+};
+
+static struct db_section *sections = NULL;
+static struct stat sections_stat; /* of the datafile they refer to */
+static int sections_valid = 0;
+
+/* counts the changes to the database items */
+static unsigned int changes = 0;
+
+#define db_set_dirty(item) \
+	(sections[item].len = 0, sections[item].saved = 0, changes++)
+
+static void journal_stop();
+static void db_item_unshare(int item);
+static void db_free_later(void *p);
+
+/*
+ * Selection: a bit per item, the bits past the last item being clear, and
+ * the number of selected items
+ */
+#define SELECTION_BITS		(sizeof(unsigned long) * 8)
+#define selection_words(n)	(((n) + SELECTION_BITS - 1) / SELECTION_BITS)
+#define selection_bit(item)	(1UL << ((item) % SELECTION_BITS))
+
+static unsigned long *selected = NULL;
+static int selected_count = 0;
+
+/* follows list_capacity, which was old_capacity */
+static void
+selection_resize(int old_capacity)
+{
+	size_t old = selection_words(old_capacity);
+	size_t n = selection_words(list_capacity);
+
+	selected = xrealloc(selected, sizeof(unsigned long) * max(n, 1));
+	if(n > old)
+		memset(&selected[old], 0, sizeof(unsigned long) * (n - old));
+}
+
+/* makes room for an unselected item before item */
+static void
+selection_insert(int item)
+{
+	size_t i, w = item / SELECTION_BITS;
+	unsigned long below = selection_bit(item) - 1;
+
+	for(i = selection_words(items + 1) - 1; i > w; i--)
+		selected[i] = selected[i] << 1 |
+			selected[i - 1] >> (SELECTION_BITS - 1);
+
+	selected[w] = (selected[w] & below) | (selected[w] & ~below) << 1;
+}
+
+static void
+selection_remove(int item)
+{
+	size_t i, w = item / SELECTION_BITS;
+	unsigned long below = selection_bit(item) - 1;
+
+	if(selected[w] & selection_bit(item))
+		selected_count--;
+
+	selected[w] = (selected[w] & below) | (selected[w] >> 1 & ~below);
+
+	for(i = w + 1; i < selection_words(items); i++) {
+		selected[i - 1] |= selected[i] << (SELECTION_BITS - 1);
+		selected[i] >>= 1;
+	}
+}
+
+int
+is_selected(int item)
+{
+	return (selected[item / SELECTION_BITS] & selection_bit(item)) != 0;
+}
+
+void
+db_select_item(int item, int value)
+{
+	if(is_selected(item) == !!value)
+		return;
+
+	selected[item / SELECTION_BITS] ^= selection_bit(item);
+	selected_count += value ? 1 : -1;
+}
+
+/* selects all the items, or none of them */
+void
+db_select_all(int value)
+{
+	size_t i, n = selection_words(items);
+
+	for(i = 0; i < n; i++)
+		selected[i] = value ? ~0UL : 0;
+
+	if(value && items % SELECTION_BITS)
+		selected[n - 1] = selection_bit(items) - 1;
+
+	selected_count = value ? items : 0;
+}
+
+void
+db_invert_selection()
+{
+	size_t i, n = selection_words(items);
+
+	for(i = 0; i < n; i++)
+		selected[i] = ~selected[i];
+
+	if(items % SELECTION_BITS)
+		selected[n - 1] &= selection_bit(items) - 1;
+
+	selected_count = items - selected_count;
+}
+
+int
+db_selected_count()
+{
+	return selected_count;
+}
+
 int standard_fields_indexed[ITEM_FIELDS];
 
 /*
@@ -62,9 +217,10 @@ abook_field standard_fields[] = {
 
 bool db_need_save = FALSE;
 
+static struct db_batch *db_batch_current();
+
 extern int first_list_item;
 extern int curitem;
-extern char *selected;
 extern char *datafile;
 
 
@@ -205,6 +361,9 @@ declare_unknown_field(char *key)
 	if(!database)
 		return;
 
+	/* the running save still reads the items */
+	save_database_finish(TRUE);
+
 	for(i = 0; i < items; i++)
 		if(database[i]) {
 			database[i] = xrealloc(database[i], ITEM_SIZE);
@@ -240,21 +399,74 @@ prepare_database_internals()
 	declare_standard_field(EMAIL);
 }
 
-int
-parse_database(FILE *in)
+/* whether validate_item() is going to truncate val */
+static int
+field_value_truncated(int field, char *val)
+{
+	size_t len = strlen(val);
+	int type;
+
+	if(len <= MAX_FIELD_LEN)
+		return 0;
+
+	get_field_info(field, NULL, NULL, &type);
+
+	return type == FIELD_STRING ||
+		(type == FIELD_EMAILS && len > MAX_EMAILSTR_LEN);
+}
+
+/* returns n if line is "[n]", -1 otherwise */
+static int
+section_number(char *line)
+{
+	char tmp[3 * sizeof(int) + 3];
+	int n = atoi(line + 1);
+
+	snprintf(tmp, sizeof(tmp), "[%d]", n);
+
+	return strcmp(tmp, line) ? -1 : n;
+}
+
+/* s is the section of the item in the file if it is not dirty */
+static void
+parse_database_add(list_item item, struct db_section *s)
+{
+	if(!db_adopt_item(item) && s)
+		sections[LAST_ITEM] = *s;
+}
+
+/*
+ * The sections of the items are only kept with track, that is when
+ * reading the datafile. A section is clean when it only has the lines
+ * write_database_put_item() writes for the item.
+ */
+static int
+real_parse_database(FILE *in, int track)
 {
-        char *line = NULL;
+	struct line_reader r;
+	struct db_section s;
+	char *line;
 	char *tmp;
 	int sec=0, field;
+	int clean = 0, ended = 0, last_field = -1;
+	off_t off;
 	list_item item;
 
+	memset(&s, 0, sizeof(s));
+	assert(!track || !db_batch_current());
+
 	item = item_create();
+	line_reader_init(&r, in);
 
 	for(;;) {
-		line = getaline(in);
-		if(feof(in)) {
+		off = line_reader_tell(&r);
+		line = line_reader_read(&r);
+		s.len = off - s.off;
+		if(line_reader_eof(&r)) {
 			if(item[field_id(NAME)] && sec) {
-				add_item2database(item);
+				parse_database_add(item,
+					(track && clean && ended) ? &s : NULL);
+				item = NULL;
 			} else {
 				item_empty(item);
 			}
@@ -262,65 +474,86 @@ parse_database(FILE *in)
 		}
 
 		if(!*line || *line == '\n' || *line == '#') {
-			goto next;
+			/* only the blank line ending the section is written */
+			if(*line || ended)
+				clean = 0;
+			ended = 1;
+			continue;
 		} else if(*line == '[') {
 			if(item[field_id(NAME)] && sec ) {
-				add_item2database(item);
+				parse_database_add(item,
+					(track && clean && ended) ? &s : NULL);
+				item = item_create();
 			} else {
 				item_empty(item);
+				memset(item, 0, ITEM_SIZE);
 			}
 			sec = 1;
-			memset(item, 0, ITEM_SIZE);
 			if(!(tmp = strchr(line, ']')))
 				sec = 0; /*incorrect section lines are skipped*/
+			s.off = off;
+			s.header = line_reader_tell(&r) - off;
+			s.n = section_number(line);
+			clean = 1;
+			ended = 0;
+			last_field = -1;
 		} else if((tmp = strchr(line, '=') ) && sec) {
 			*tmp++ = '\0';
 			find_field_number(line, &field);
 			if(field != -1) {
 				item[field] = xstrdup(tmp);
-				goto next;
 			} else if(!strcasecmp(opt_get_str(STR_PRESERVE_FIELDS),
 						"all")){
 				declare_unknown_field(line);
 				item = xrealloc(item, ITEM_SIZE);
 				item[fields_count - 1] = xstrdup(tmp);
-				goto next;
+				field = fields_count - 1;
 			}
-		}
-next:
-		xfree(line);
+			if(field <= last_field || ended || !*tmp ||
+					field_value_truncated(field, tmp))
+				clean = 0;
+			last_field = field;
+		} else
+			clean = 0;
 	}
 
-	xfree(line);
+	line_reader_free(&r);
 	item_free(&item);
-	db_need_save = FALSE;
+	if(!db_batch_current())
+		db_need_save = FALSE;
 
 	return 0;
 }
 
+int
+parse_database(FILE *in)
+{
+	return real_parse_database(in, 0);
+}
+
 int
 load_database(char *filename)
 {
 	FILE *in;
 
+	save_database_finish(TRUE);
+
 	if(database != NULL)
 		close_database();
 
 	if ((in = abook_fopen(filename, "r")) == NULL)
 		return -1;
 
-	parse_database(in);
+	real_parse_database(in, 1);
+	sections_valid = !fstat(fileno(in), &sections_stat);
+	fclose(in);
 
 	return (items == 0) ? 2 : 0;
 }
 
-int
-write_database(FILE *out, struct db_enumerator e)
+void
+write_database_head(FILE *out)
 {
-	int j;
-	int i = 0;
-	abook_field_list *cur;
-
 	fprintf(out,
 		"# abook addressbook file\n\n"
 		"[format]\n"
@@ -328,133 +561,594 @@ write_database(FILE *out, struct db_enumerator e)
 		"version=" VERSION "\n"
 		"\n\n"
 	);
+}
 
-	db_enumerate_items(e) {
-		fprintf(out, "[%d]\n", i);
-
-		for(cur = fields_list, j = 0; cur; cur = cur->next, j++) {
-			if( database[e.item][j] != NULL &&
-					*database[e.item][j] )
-				fprintf(out, "%s=%s\n",
-					cur->field->key,
-					database[e.item][j]
-					);
-		}
+static void
+write_database_put_header(struct outbuf *b, int n)
+{
+	outbuf_putc(b, '[');
+	outbuf_int(b, n);
+	outbuf_literal(b, "]\n");
+}
+
+/*
+ * The keys of the fields, NULL for the ones that are not exported (see
+ * db_set_projection()) when projected is TRUE
+ */
+static char **
+db_field_keys(int projected)
+{
+	char **keys = xmalloc(sizeof(char *) * max(fields_count, 1));
+	abook_field_list *cur;
+	int j;
+
+	for(cur = fields_list, j = 0; cur; cur = cur->next, j++)
+		keys[j] = (!projected || field_shown(j)) ?
+			cur->field->key : NULL;
+
+	return keys;
+}
 
-		fputc('\n', out);
-		i++;
+static void
+write_database_put_fields(struct outbuf *b, list_item item, char **keys,
+		int n_fields)
+{
+	int j;
+
+	for(j = 0; j < n_fields; j++) {
+		if( keys[j] && item[j] != NULL && *item[j] ) {
+			outbuf_puts(b, keys[j]);
+			outbuf_putc(b, '=');
+			outbuf_puts(b, item[j]);
+			outbuf_putc(b, '\n');
+		}
 	}
 
-	return 0;
+	outbuf_putc(b, '\n');
+}
+
+static void
+write_database_put_item(struct outbuf *b, int item, int n, char **keys)
+{
+	write_database_put_header(b, n);
+	write_database_put_fields(b, database[item], keys, fields_count);
+}
+
+/* n is the position of the item in the written file */
+void
+write_database_item(FILE *out, int item, int n)
+{
+	struct outbuf b;
+	char space[BUFSIZ];
+	char **keys = db_field_keys(TRUE);
+
+	outbuf_init(&b, out, space, sizeof(space));
+	write_database_put_item(&b, item, n, keys);
+	outbuf_flush(&b);
+	free(keys);
 }
 
 int
-save_database(int force_save)
+write_database(FILE *out, struct db_enumerator e)
 {
+	struct outbuf b;
+	char **keys = db_field_keys(TRUE);
+	int i = 0, ret;
 
-	// officialize this the day we are sure that db_need_save cover all possible
-	// modifications of the database using the UI
-#ifdef DEBUG
-	if(! db_need_save && force_save != 1) {
-		fprintf(stderr, "[debug] database unmodified, request to write on-disk ignored\n");
-		return 0;
+	write_database_head(out);
+
+	outbuf_init(&b, out, NULL, OUTBUF_BLOCK);
+
+	db_enumerate_items(e)
+		write_database_put_item(&b, e.item, i++, keys);
+
+	ret = outbuf_flush(&b);
+	outbuf_free(&b);
+	free(keys);
+
+	return ret;
+}
+
+/*
+ * Saving writes the datafile from a snapshot of the items, on a thread of
+ * its own for the interactive UI. An item changed before the save is over
+ * is copied first, the snapshot keeping the previous array, and the values
+ * dropped by the database meanwhile are only freed at the end: they are
+ * replaced, never changed in place.
+ */
+struct db_save {
+	char *datafile;
+	list_item *items;
+	int n;
+	char **keys;
+	int n_fields;
+	struct db_section *sections;	/* NULL if they are not valid */
+	struct stat sections_stat;
+	unsigned int changes;		/* of the database when started */
+
+	struct db_section *written;	/* where the items went */
+	struct stat st;
+	int ret;
+
+	pthread_t thread;
+	int running;
+	pthread_mutex_t lock;
+	int done;
+
+	list_item *shared;		/* hash of the items arrays */
+	size_t shared_mask;
+	void **garbage;			/* to free at the end */
+	int garbage_n, garbage_capacity;
+};
+
+static struct db_save *save = NULL;
+
+#define save_slot(s, item) \
+	((size_t)(item) / sizeof(char *) * 2654435761u & (s)->shared_mask)
+
+/*
+ * Copies parts of the previous datafile into the new one
+ */
+
+#define DATAFILE_WINDOW		65536
+
+struct datafile_copy {
+	int fd;
+	char *buf;	/* data read at start */
+	off_t start;
+	size_t len;
+};
+
+static int
+datafile_copy(struct datafile_copy *c, struct outbuf *b, off_t off,
+		size_t len)
+{
+	ssize_t n;
+
+#ifdef HAVE_COPY_FILE_RANGE
+	/* large ranges don't need to go through the buffers */
+	if(len >= DATAFILE_WINDOW) {
+		if(outbuf_flush(b) || fflush(b->f))
+			return -1;
+		while(len > 0 && (n = copy_file_range(c->fd, &off,
+						fileno(b->f), NULL, len, 0)) > 0)
+			len -= n;
+		/* what's left is read(), e.g. across file systems */
 	}
 #endif
 
+	while(len > 0) {
+		if(off < c->start || off >= c->start + (off_t)c->len) {
+			n = pread(c->fd, c->buf, DATAFILE_WINDOW, off);
+			if(n <= 0)
+				return -1;
+			c->start = off;
+			c->len = n;
+		}
+		n = min(len, c->start + c->len - off);
+		outbuf_add(b, c->buf + (off - c->start), n);
+		off += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* returns the descriptor of the datafile if it is the one of sections */
+static int
+datafile_open_sections(struct db_save *s)
+{
+	struct stat st;
+	int fd;
+
+	if(!s->sections || (fd = open(s->datafile, O_RDONLY)) == -1)
+		return -1;
+
+	/* a rewrite within the same second can keep the size and mtime */
+	if(fstat(fd, &st) || st.st_dev != s->sections_stat.st_dev ||
+			st.st_ino != s->sections_stat.st_ino ||
+			st.st_size != s->sections_stat.st_size ||
+			st.st_mtim.tv_sec != s->sections_stat.st_mtim.tv_sec ||
+			st.st_mtim.tv_nsec != s->sections_stat.st_mtim.tv_nsec ||
+			st.st_ctim.tv_sec != s->sections_stat.st_ctim.tv_sec ||
+			st.st_ctim.tv_nsec != s->sections_stat.st_ctim.tv_nsec) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Writes the same as write_database(out, ENUM_ALL) for the items of s,
+ * copying the ones that are not dirty from the datafile when it did not
+ * change. Where the items went is stored in s->written.
+ */
+static int
+write_datafile(struct db_save *s, FILE *out)
+{
+	static const struct db_section dirty;
+	const struct db_section *from;
+	struct datafile_copy c;
+	struct db_section *w;
+	struct outbuf b;
+	off_t run_off = 0, pos;
+	size_t run_len = 0;
+	int i, ret = 0;
+
+	c.fd = datafile_open_sections(s);
+	c.buf = (c.fd == -1) ? NULL : xmalloc(DATAFILE_WINDOW);
+	c.start = c.len = 0;
+
+	write_database_head(out);
+	pos = ftello(out);
+
+	outbuf_init(&b, out, NULL, OUTBUF_BLOCK);
+
+	for(i = 0; i < s->n && !ret; i++) {
+		from = (c.fd == -1) ? &dirty : &s->sections[i];
+		w = &s->written[i];
+		w->off = pos;
+		w->n = i;
+		w->saved = 0;
+
+		/* consecutive unchanged items are copied in one go */
+		if(from->len && from->n == i) {
+			if(run_len && run_off + (off_t)run_len != from->off) {
+				ret = datafile_copy(&c, &b, run_off, run_len);
+				run_len = 0;
+			}
+			if(!run_len)
+				run_off = from->off;
+			run_len += from->len;
+			w->header = from->header;
+			w->len = from->len;
+			pos += w->len;
+			continue;
+		}
+
+		if(run_len) {
+			ret = datafile_copy(&c, &b, run_off, run_len);
+			run_len = 0;
+		}
+
+		w->len = outbuf_tell(&b);
+		write_database_put_header(&b, i);
+		w->header = outbuf_tell(&b) - w->len;
+		if(from->len) {
+			ret = ret || datafile_copy(&c, &b,
+					from->off + from->header,
+					from->len - from->header);
+			w->len = w->header + from->len - from->header;
+		} else {
+			write_database_put_fields(&b, s->items[i], s->keys,
+					s->n_fields);
+			w->len = outbuf_tell(&b) - w->len;
+		}
+		pos += w->len;
+	}
+
+	if(run_len && !ret)
+		ret = datafile_copy(&c, &b, run_off, run_len);
+
+	if(outbuf_flush(&b))
+		ret = 1;
+
+	outbuf_free(&b);
+	xfree(c.buf);
+	if(c.fd != -1)
+		close(c.fd);
+
+	return ret;
+}
+
+/* writes the datafile of s, which does not use the database itself */
+static int
+save_write(struct db_save *s)
+{
 	FILE *out;
-	int ret = 0;
-	struct db_enumerator e = init_db_enumerator(ENUM_ALL);
-	char *datafile_new = strconcat(datafile, ".new", NULL);
-	char *datafile_old = strconcat(datafile, "~", NULL);
+	int fd = -1, ret = 0;
+	char *datafile_new = strconcat(s->datafile, ".new", NULL);
+	char *datafile_old = strconcat(s->datafile, "~", NULL);
 
 	if( (out = abook_fopen(datafile_new, "w")) == NULL ) {
 		ret = -1;
 		goto out;
 	}
 
-	if(!list_is_empty())
-		/*
-		 * Possibly should check if write_database failed.
-		 * Currently it returns always zero.
-		 */
-		write_database(out, e);
+	if(s->n > 0) {
+		s->written = xmalloc(sizeof(struct db_section) * s->n);
+		if(write_datafile(s, out))
+			ret = -1;
+	}
 
-	fclose(out);
+	/* the renames change its ctime, it is looked at once they are done */
+	if(s->written && (fflush(out) || (fd = dup(fileno(out))) == -1))
+		xfree(s->written);
 
-	if(access(datafile, F_OK) == 0 &&
-			(rename(datafile, datafile_old)) == -1)
+	if(fclose(out) || ret) {
+		/* keep the previous datafile */
+		unlink(datafile_new);
 		ret = -1;
+		goto out;
+	}
 
-	if((rename(datafile_new, datafile)) == -1)
+	if(access(s->datafile, F_OK) == 0 &&
+			(rename(s->datafile, datafile_old)) == -1)
 		ret = -1;
 
-	if(ret == 0) {
-		db_need_save = FALSE;
-		refresh_screen();
-	}
+	if((rename(datafile_new, s->datafile)) == -1)
+		ret = -1;
+
+	if(s->written && fstat(fd, &s->st))
+		xfree(s->written);
 
 out:
+	if(fd != -1)
+		close(fd);
 	free(datafile_new);
 	free(datafile_old);
 	return ret;
 }
 
-static void
-db_free_item(int item)
+static void *
+save_thread(void *arg)
 {
-	item_empty(database[item]);
+	struct db_save *s = arg;
+	int ret = save_write(s);
+
+	pthread_mutex_lock(&s->lock);
+	s->ret = ret;
+	s->done = TRUE;
+	pthread_mutex_unlock(&s->lock);
+
+	return NULL;
 }
 
-void
-close_database()
+static void
+save_snapshot()
 {
+	struct db_save *s = xmalloc0(sizeof(struct db_save));
+	size_t size, j;
 	int i;
 
-	for(i=0; i <= LAST_ITEM; i++)
-		db_free_item(i);
+	assert(!save);
 
-	xfree(database);
-	free(selected);
+	s->datafile = xstrdup(datafile);
+	s->n = items;
+	s->items = xmalloc(sizeof(list_item) * max(items, 1));
+	s->keys = db_field_keys(FALSE);
+	s->n_fields = fields_count;
+	s->changes = changes;
 
-	database = NULL;
-	selected = NULL;
+	if(sections_valid) {
+		s->sections = xmalloc(sizeof(struct db_section) *
+				max(items, 1));
+		s->sections_stat = sections_stat;
+	}
 
-	items = 0;
-	first_list_item = curitem = -1;
-	list_capacity = 0;
-}
+	for(size = 2; size < 2 * (size_t)items; size *= 2)
+		;
+	s->shared = xmalloc0(sizeof(list_item) * size);
+	s->shared_mask = size - 1;
+
+	for(i = 0; i < items; i++) {
+		s->items[i] = database[i];
+		if(s->sections)
+			s->sections[i] = sections[i];
+		sections[i].saved = i + 1;
+
+		for(j = save_slot(s, database[i]); s->shared[j];
+				j = (j + 1) & s->shared_mask)
+			;
+		s->shared[j] = database[i];
+	}
+
+	pthread_mutex_init(&s->lock, NULL);
 
+	save = s;
+}
 
+/* copies the item before it changes if the running save reads it */
 static void
-validate_item(list_item item)
+db_item_unshare(int item)
 {
-	abook_field_list *f;
-	int i, max_field_len;
-	char *tmp;
+	list_item copy;
+	size_t j;
 
-	for(f = fields_list, i = 0; f; f = f->next, i++) {
-		max_field_len = 0;
+	if(!save)
+		return;
 
-		switch(f->field->type) {
-			case FIELD_EMAILS:
-				max_field_len = MAX_EMAILSTR_LEN;
-				if(item[i] == NULL)
-					item[i] = xstrdup("");
-				break;
-			case FIELD_LIST:
-				/* TODO quote string if it contains commas */
-				break;
-			case FIELD_STRING:
-				max_field_len = MAX_FIELD_LEN;
-				break;
-			case FIELD_DATE:
-				break;
-			default:
-				assert(0);
+	for(j = save_slot(save, database[item]); save->shared[j];
+			j = (j + 1) & save->shared_mask)
+		if(save->shared[j] == database[item]) {
+			copy = xmalloc(ITEM_SIZE);
+			memcpy(copy, database[item], ITEM_SIZE);
+			db_free_later(database[item]);
+			database[item] = copy;
+			return;
+		}
+}
+
+/* frees p, at the end of the running save if any */
+static void
+db_free_later(void *p)
+{
+	if(!save || !p) {
+		free(p);
+		return;
+	}
+
+	if(save->garbage_n == save->garbage_capacity) {
+		save->garbage_capacity = save->garbage_capacity ?
+			2 * save->garbage_capacity : 64;
+		save->garbage = xrealloc(save->garbage,
+				sizeof(void *) * save->garbage_capacity);
+	}
+
+	save->garbage[save->garbage_n++] = p;
+}
+
+/*
+ * Ends the running save, waiting for it unless wait is FALSE. Returns 1
+ * while it goes on, 2 if there is none, and what save_database() returns
+ * otherwise.
+ */
+int
+save_database_finish(int wait)
+{
+	struct db_save *s = save;
+	int i, done, ret;
+
+	if(!s)
+		return 2;
+
+	if(s->running) {
+		pthread_mutex_lock(&s->lock);
+		done = s->done;
+		pthread_mutex_unlock(&s->lock);
+		if(!done && !wait)
+			return 1;
+		pthread_join(s->thread, NULL);
+	}
+
+	ret = s->ret;
+
+	/* where the items that did not change meanwhile are now */
+	for(i = 0; i < items; i++) {
+		if(ret == 0 && s->written && sections[i].saved)
+			sections[i] = s->written[sections[i].saved - 1];
+		sections[i].saved = 0;
+	}
+
+	if(ret == 0) {
+		sections_valid = s->written != NULL;
+		sections_stat = s->st;
+		if(changes == s->changes)
+			db_need_save = FALSE;
+	}
+
+	save = NULL;
+
+	for(i = 0; i < s->garbage_n; i++)
+		free(s->garbage[i]);
+	free(s->garbage);
+	free(s->shared);
+	pthread_mutex_destroy(&s->lock);
+	free(s->written);
+	free(s->sections);
+	free(s->keys);
+	free(s->items);
+	free(s->datafile);
+	free(s);
+
+	return ret;
+}
+
+/* starts saving the datafile, see save_database_finish() */
+void
+save_database_background()
+{
+	save_database_finish(TRUE);
+	save_snapshot();
+
+	if(pthread_create(&save->thread, NULL, save_thread, save) == 0)
+		save->running = TRUE;
+	else
+		save->ret = save_write(save);
+}
+
+int
+save_database(int force_save)
+{
+
+	// officialize this the day we are sure that db_need_save cover all possible
+	// modifications of the database using the UI
+#ifdef DEBUG
+	if(! db_need_save && force_save != 1) {
+		fprintf(stderr, "[debug] database unmodified, request to write on-disk ignored\n");
+		return 0;
+	}
+#endif
+
+	int ret;
+
+	save_database_finish(TRUE);
+	save_snapshot();
+	save->ret = save_write(save);
+
+	if((ret = save_database_finish(TRUE)) == 0)
+		refresh_screen();
+
+	return ret;
+}
+
+
+static void
+db_free_item(int item)
+{
+	item_empty(database[item]);
+}
+
+void
+close_database()
+{
+	int i;
+
+	save_database_finish(TRUE);
+
+	for(i=0; i <= LAST_ITEM; i++)
+		db_free_item(i);
+
+	xfree(database);
+	xfree(selected);
+	xfree(sections);
+
+	database = NULL;
+	selected_count = 0;
+	sections_valid = 0;
+	changes++;
+
+	db_complete_free();
+	journal_stop();
+
+	items = 0;
+	first_list_item = curitem = -1;
+	list_capacity = 0;
+}
+
+
+static void
+validate_item(list_item item)
+{
+	abook_field_list *f;
+	int i, max_field_len;
+	char *tmp;
+
+	for(f = fields_list, i = 0; f; f = f->next, i++) {
+		max_field_len = 0;
+
+		switch(f->field->type) {
+			case FIELD_EMAILS:
+				max_field_len = MAX_EMAILSTR_LEN;
+				if(item[i] == NULL)
+					item[i] = xstrdup("");
+				break;
+			case FIELD_LIST:
+				/* TODO quote string if it contains commas */
+				break;
+			case FIELD_STRING:
+				max_field_len = MAX_FIELD_LEN;
+				break;
+			case FIELD_DATE:
+				break;
+			default:
+				assert(0);
 		}
 
+		/* only look at the first max_field_len bytes */
 		if(max_field_len && item[i] &&
-				((int)strlen(item[i]) > max_field_len)) {
+				!memchr(item[i], 0, max_field_len + 1)) {
 			/* truncate field */
 			tmp = item[i];
 			item[i][max_field_len - 1] = 0;
@@ -464,9 +1158,31 @@ validate_item(list_item item)
 	}
 }
 
+/* make room for at least n items, without shrinking */
+static void
+reserve_list_capacity(int n)
+{
+	int old_capacity = list_capacity;
+
+	if(n <= list_capacity)
+		return;
+
+	if(list_capacity < 1)
+		list_capacity = INITIAL_LIST_CAPACITY;
+	while(list_capacity < n)
+		list_capacity *= 2;
+
+	database = xrealloc(database, sizeof(list_item) * list_capacity);
+	selection_resize(old_capacity);
+	sections = xrealloc(sections,
+			sizeof(struct db_section) * list_capacity);
+}
+
 static void
 adjust_list_capacity()
 {
+	int old_capacity = list_capacity;
+
 	if(list_capacity < 1)
 		list_capacity = INITIAL_LIST_CAPACITY;
 	else if(items >= list_capacity)
@@ -481,259 +1197,1430 @@ adjust_list_capacity()
 	else /* allocate memory _and_ initialize pointers to NULL */
 		database = xmalloc0(sizeof(list_item) * list_capacity);
 
-	selected = xrealloc(selected, list_capacity);
+	selection_resize(old_capacity);
+	sections = xrealloc(sections,
+			sizeof(struct db_section) * list_capacity);
+}
+
+/*
+ * Undo journal: the changes of the items as records of single fields and
+ * of insertions and removals of empty items, in steps undone and redone
+ * as a whole. The records are only kept from a db_journal_step() on;
+ * closing the database or a step outgrowing JOURNAL_MAX_SIZE empties the
+ * journal and stops it until the next step.
+ */
+#define JOURNAL_MAX_SIZE	(4 * 1024 * 1024)
+
+/* the sections don't follow the items around */
+static void
+db_set_all_dirty()
+{
+	int i;
+
+	for(i = 0; i < items; i++)
+		db_set_dirty(i);
+}
+
+enum {
+	JOURNAL_FIELD,	/* field of item changed from old to new */
+	JOURNAL_INSERT,	/* an empty item inserted at item */
+	JOURNAL_REMOVE,	/* the empty item at item removed */
+	JOURNAL_SWAP,	/* item swapped with the item field */
+	JOURNAL_ORDER	/* the field items put in order, see db_sort() */
+};
+
+struct journal_rec {
+	int type;
+	int step;	/* the first record of a step */
+	int item;
+	int field;
+	char *old, *new; /* the value which is not in the database is owned */
+	int *order;
+	size_t size;
+};
+
+static struct journal_rec *journal = NULL;
+static int journal_n = 0, journal_pos = 0, journal_capacity = 0;
+static size_t journal_size = 0;
+static int journal_recording = FALSE, journal_new_step = FALSE;
+
+static void
+journal_rec_free(struct journal_rec *r, int done)
+{
+	if(r->type == JOURNAL_FIELD)
+		db_free_later(done ? r->old : r->new);
+	free(r->order);
+	journal_size -= r->size;
+}
+
+static void
+journal_clear()
+{
+	int i;
+
+	for(i = 0; i < journal_n; i++)
+		journal_rec_free(&journal[i], i < journal_pos);
+
+	xfree(journal);
+	journal_n = journal_pos = journal_capacity = 0;
+}
+
+/* empties the journal until the next step */
+static void
+journal_stop()
+{
+	journal_clear();
+	journal_recording = FALSE;
+}
+
+/* drops the oldest steps, or all the journal if the current step is big */
+static void
+journal_shrink()
+{
+	int i, cur;
+
+	for(cur = journal_n - 1; cur > 0 && !journal[cur].step; cur--)
+		;
+
+	for(i = 0; i < cur && journal_size > JOURNAL_MAX_SIZE / 4 * 3; )
+		do
+			journal_rec_free(&journal[i++], TRUE);
+		while(i < cur && !journal[i].step);
+
+	memmove(journal, &journal[i], sizeof(*journal) * (journal_n - i));
+	journal_n -= i;
+	journal_pos -= i;
+
+	if(journal_size > JOURNAL_MAX_SIZE)
+		journal_stop();
+}
+
+/* takes old over, which is freed right away if nothing is recorded */
+static void
+journal_add(int type, int item, int field, char *old, char *new, int *order)
+{
+	struct journal_rec *r;
+	int i;
+
+	if(!journal_recording) {
+		db_free_later(old);
+		free(order);
+		return;
+	}
+
+	/* the undone steps cannot be redone after a change */
+	for(i = journal_pos; i < journal_n; i++)
+		journal_rec_free(&journal[i], FALSE);
+	journal_n = journal_pos;
+
+	if(journal_n == journal_capacity) {
+		journal_capacity = journal_capacity ? 2 * journal_capacity : 64;
+		journal = xrealloc(journal, sizeof(*journal) *
+				journal_capacity);
+	}
+
+	r = &journal[journal_n];
+	r->type = type;
+	r->step = journal_new_step || !journal_n;
+	r->item = item;
+	r->field = field;
+	r->old = old;
+	r->new = new;
+	r->order = order;
+	r->size = sizeof(*r) + (old ? strlen(old) + 1 : 0) +
+		(new ? strlen(new) + 1 : 0) +
+		(order ? sizeof(int) * field : 0);
+
+	journal_pos = ++journal_n;
+	journal_new_step = FALSE;
+
+	if((journal_size += r->size) > JOURNAL_MAX_SIZE)
+		journal_shrink();
+}
+
+/* records the insertion of the item with its fields */
+static void
+journal_item_added(int item)
+{
+	int i;
+
+	journal_add(JOURNAL_INSERT, item, 0, NULL, NULL, NULL);
+
+	for(i = 0; i < fields_count && journal_recording; i++)
+		if(database[item][i])
+			journal_add(JOURNAL_FIELD, item, i, NULL,
+					database[item][i], NULL);
+}
+
+/*
+ * Makes the following changes a new step for db_undo(), starting the
+ * journal if needed
+ */
+void
+db_journal_step()
+{
+	journal_recording = TRUE;
+	journal_new_step = TRUE;
+}
+
+static void
+db_insert_empty(int item)
+{
+	reserve_list_capacity(items + 1);
+
+	memmove(&database[item + 1], &database[item],
+			sizeof(list_item) * (items - item));
+	selection_insert(item);
+	memmove(&sections[item + 1], &sections[item],
+			sizeof(struct db_section) * (items - item));
+	items++;
+
+	database[item] = item_create();
+	memset(&sections[item], 0, sizeof(struct db_section));
+	db_set_dirty(item);
+}
+
+static void
+db_remove_empty(int item)
+{
+	db_free_later(database[item]);
+
+	selection_remove(item);
+	items--;
+	memmove(&database[item], &database[item + 1],
+			sizeof(list_item) * (items - item));
+	memmove(&sections[item], &sections[item + 1],
+			sizeof(struct db_section) * (items - item));
+	changes++;
+}
+
+/* puts val into a field, the old value being freed or recorded */
+static void
+db_field_set(int item, int id, char *val)
+{
+	char *old = database[item][id];
+
+	if(old == val)
+		return;
+
+	if(old && val && !strcmp(old, val)) {
+		free(val);
+		return;
+	}
+
+	db_item_unshare(item);
+	database[item][id] = val;
+	db_set_dirty(item);
+	db_need_save = TRUE;
+
+	journal_add(JOURNAL_FIELD, item, id, old, val, NULL);
+}
+
+static void
+db_remove_item(int item)
+{
+	int i;
+
+	db_item_unshare(item);
+
+	for(i = 0; i < fields_count; i++)
+		if(database[item][i]) {
+			journal_add(JOURNAL_FIELD, item, i, database[item][i],
+					NULL, NULL);
+			database[item][i] = NULL;
+		}
+
+	journal_add(JOURNAL_REMOVE, item, 0, NULL, NULL, NULL);
+	db_remove_empty(item);
+	db_need_save = TRUE;
+}
+
+static void
+db_merge_items(int dest, int src)
+{
+	list_item merged = item_create(), tmp = item_create();
+	int i;
+
+	/* item_merge() changes the fields in place, which the journal
+	   could not follow */
+	item_duplicate(merged, database[dest]);
+	item_duplicate(tmp, database[src]);
+	item_merge(merged, tmp);
+	item_free(&tmp);
+
+	for(i = 0; i < fields_count; i++)
+		db_field_set(dest, i, merged[i]);
+	item_free(&merged);
+
+	db_remove_item(src);
+}
+
+void
+db_swap_items(int a, int b)
+{
+	list_item tmp = database[a];
+
+	database[a] = database[b];
+	database[b] = tmp;
+	db_set_dirty(a);
+	db_set_dirty(b);
+	db_need_save = TRUE;
+
+	journal_add(JOURNAL_SWAP, a, b, NULL, NULL, NULL);
+}
+
+static void
+journal_apply(struct journal_rec *r, int undo)
+{
+	list_item item, *tmp;
+	int i;
+
+	switch(r->type) {
+		case JOURNAL_FIELD:
+			db_item_unshare(r->item);
+			database[r->item][r->field] = undo ? r->old : r->new;
+			db_set_dirty(r->item);
+			break;
+		case JOURNAL_INSERT:
+		case JOURNAL_REMOVE:
+			if((r->type == JOURNAL_INSERT) == !undo)
+				db_insert_empty(r->item);
+			else
+				db_remove_empty(r->item);
+			break;
+		case JOURNAL_SWAP:
+			item = database[r->item];
+			database[r->item] = database[r->field];
+			database[r->field] = item;
+			db_set_dirty(r->item);
+			db_set_dirty(r->field);
+			break;
+		case JOURNAL_ORDER:
+			tmp = xmalloc(sizeof(list_item) * max(r->field, 1));
+			memcpy(tmp, database, sizeof(list_item) * r->field);
+			for(i = 0; i < r->field; i++)
+				if(undo)
+					database[r->order[i]] = tmp[i];
+				else
+					database[i] = tmp[r->order[i]];
+			free(tmp);
+			db_select_all(FALSE);
+			db_set_all_dirty();
+			break;
+		default:
+			assert(0);
+	}
+}
+
+/* the item which a record is about, if it is still there */
+static int
+journal_rec_item(struct journal_rec *r)
+{
+	if(r->type == JOURNAL_ORDER || r->item >= items)
+		return -1;
+
+	return r->item;
+}
+
+/*
+ * Undoes the last step, putting the first item it changed into *item if
+ * that is still there and -1 otherwise. Returns FALSE if there was
+ * nothing to undo.
+ */
+int
+db_undo(int *item)
+{
+	int i;
+
+	if(!journal_pos)
+		return FALSE;
+
+	for(i = journal_pos - 1; !journal[i].step; i--)
+		journal_apply(&journal[i], TRUE);
+	journal_apply(&journal[i], TRUE);
+
+	journal_pos = i;
+	journal_new_step = TRUE;
+	db_need_save = TRUE;
+	*item = journal_rec_item(&journal[i]);
+
+	return TRUE;
+}
+
+/* like db_undo(), for the last step undone */
+int
+db_redo(int *item)
+{
+	int i = journal_pos;
+
+	if(journal_pos == journal_n)
+		return FALSE;
+
+	do
+		journal_apply(&journal[i++], FALSE);
+	while(i < journal_n && !journal[i].step);
+
+	*item = journal_rec_item(&journal[journal_pos]);
+	journal_pos = i;
+	journal_new_step = TRUE;
+	db_need_save = TRUE;
+
+	return TRUE;
+}
+
+/*
+ * item batches
+ */
+
+static pthread_key_t batch_key;
+static pthread_once_t batch_key_once = PTHREAD_ONCE_INIT;
+
+static void
+create_batch_key()
+{
+	pthread_key_create(&batch_key, NULL);
+}
+
+void
+db_batch_init(struct db_batch *b)
+{
+	b->items = NULL;
+	b->count = b->capacity = 0;
+	b->lock = NULL;
+}
+
+/*
+ * Makes db_adopt_item() calls from the current thread add their
+ * item to b instead of the database. A NULL b restores the default.
+ */
+void
+db_batch_redirect(struct db_batch *b)
+{
+	pthread_once(&batch_key_once, create_batch_key);
+	pthread_setspecific(batch_key, b);
+}
+
+static struct db_batch *
+db_batch_current()
+{
+	pthread_once(&batch_key_once, create_batch_key);
+	return pthread_getspecific(batch_key);
+}
+
+/* does not touch any global state, so that batches can be filled
+   concurrently */
+static void
+db_batch_add(struct db_batch *b, list_item item)
+{
+	if(b->count >= b->capacity) {
+		b->capacity = b->capacity ? b->capacity * 2 :
+			INITIAL_LIST_CAPACITY;
+		b->items = xrealloc(b->items, sizeof(list_item) * b->capacity);
+	}
+
+	if(b->lock)
+		pthread_mutex_lock(b->lock);
+	b->items[b->count++] = item;
+	if(b->lock)
+		pthread_mutex_unlock(b->lock);
+}
+
+/* Appends the items of the batch to the database, emptying the batch */
+int
+db_batch_commit(struct db_batch *b)
+{
+	int i, n = b->count;
+
+	if(!n)
+		return 0;
+
+	reserve_list_capacity(items + n);
+
+	memcpy(&database[items], b->items, sizeof(list_item) * n);
+	memset(&sections[items], 0, sizeof(struct db_section) * n);
+	items += n;
+	changes++;
+
+	for(i = items - n; i < items && journal_recording; i++)
+		journal_item_added(i);
+
+	b->count = 0;
+	db_need_save = TRUE;
+
+	return n;
+}
+
+void
+db_batch_free(struct db_batch *b)
+{
+	int i;
+
+	for(i = 0; i < b->count; i++) {
+		item_empty(b->items[i]);
+		item_free(&b->items[i]);
+	}
+
+	xfree(b->items);
+	b->count = b->capacity = 0;
+}
+
+/*
+ * item streaming
+ */
+
+static void (*stream_func) (int item, void *data) = NULL;
+static void *stream_data = NULL;
+
+/*
+ * Makes db_adopt_item() hand each item to func instead of keeping it: the
+ * item is the only one of the database while func runs, and is freed
+ * right after. A NULL func restores the default.
+ */
+void
+db_stream_redirect(void (*func) (int item, void *data), void *data)
+{
+	stream_func = func;
+	stream_data = data;
+}
+
+static void
+db_stream_item(list_item item)
+{
+	assert(!items);
+
+	if(list_capacity < 1)
+		adjust_list_capacity();
+
+	database[0] = item;
+	db_set_dirty(0);
+	items = 1;
+
+	(*stream_func) (0, stream_data);
+
+	item_empty(database[0]);
+	item_free(&database[0]);
+	items = 0;
+}
+
+/*
+ * Appends item to the database, taking ownership of the item itself and
+ * not only of its fields: the caller must not use or free it afterwards,
+ * even when it is rejected.
+ */
+int
+db_adopt_item(list_item item)
+{
+	struct db_batch *batch;
+
+	/* 'name' field is mandatory */
+	if((item[field_id(NAME)] == NULL) || ! *item[field_id(NAME)]) {
+		item_empty(item);
+		item_free(&item);
+		return 1;
+	}
+
+	validate_item(item);
+
+	if((batch = db_batch_current()) != NULL) {
+		db_batch_add(batch, item);
+		return 0;
+	}
+
+	if(stream_func) {
+		db_stream_item(item);
+		return 0;
+	}
+
+	if(++items > list_capacity)
+		adjust_list_capacity();
+
+	database[LAST_ITEM] = item;
+	db_set_dirty(LAST_ITEM);
+	db_need_save = TRUE;
+
+	if(journal_recording)
+		journal_item_added(LAST_ITEM);
+
+	return 0;
+}
+
+/* the fields of item are moved to the database, item itself is not */
+int
+add_item2database(list_item item)
+{
+	list_item new_item;
+
+	if((item[field_id(NAME)] == NULL) || ! *item[field_id(NAME)]) {
+		item_empty(item);
+		return 1;
+	}
+
+	new_item = item_create();
+	item_copy(new_item, item);
+
+	return db_adopt_item(new_item);
+}
+
+
+void
+remove_selected_items()
+{
+	int j;
+
+	if(list_is_empty())
+		return;
+
+	if(!selected_count) {
+		if(list_get_curitem() < 0)
+			return;
+		db_select_item(list_get_curitem(), TRUE);
+	}
+
+	for(j = LAST_ITEM; j >= 0; j--)
+		if(is_selected(j))
+			db_remove_item(j);
+
+	if(curitem > LAST_ITEM && items > 0)
+		curitem = LAST_ITEM;
+
+	adjust_list_capacity();
+
+	select_none();
+}
+
+void merge_selected_items()
+{
+	int j;
+	int destitem = -1;
+
+	if((list_is_empty()) || (selected_count < 2))
+		return;
+
+	/* Find the top item */
+	for(j=0; destitem < 0; j++)
+		if(is_selected(j))
+			destitem = j;
+
+	/* Merge pairwise */
+	for(j = LAST_ITEM; j > destitem; j--)
+		if(is_selected(j))
+			db_merge_items(destitem, j);
+
+	if(curitem > LAST_ITEM && items > 0)
+		curitem = LAST_ITEM;
+
+	adjust_list_capacity();
+
+	select_none();
+}
+
+void remove_duplicates()
+{
+	int i,j;
+	char *tmpj;
+	if(list_is_empty())
+		return;
+
+	/* Scan from the last one */
+	for(j = LAST_ITEM - 1; j >= 0; j--) {
+		tmpj = db_name_get(j);
+		for(i = LAST_ITEM; i > j; i--)
+			/* Check name and merge if dups */
+			if (0 == strcmp(tmpj,db_name_get(i))) {
+				db_merge_items(j, i);
+				if (curitem == i) curitem--;
+			}
+	}
+
+	adjust_list_capacity();
+}
+
+
+char *
+get_surname(char *s)
+{
+	char *p = s + strlen(s);
+
+	assert(s != NULL);
+
+	while(p > s && *(p - 1) != ' ')
+		p--;
+
+	return xstrdup(p);
+}
+
+static int
+surnamecmp(const void *i1, const void *i2)
+{
+	int ret, idx = field_id(NAME);
+	char *n1, *n2, *s1, *s2;
+
+	n1 = (*(list_item *)i1)[idx];
+	n2 = (*(list_item *)i2)[idx];
+
+	s1 = get_surname(n1);
+	s2 = get_surname(n2);
+
+	if( !(ret = safe_strcoll(s1, s2)) )
+		ret = safe_strcoll(n1, n2);
+
+	free(s1);
+	free(s2);
+
+	return ret;
+}
+
+static int sort_field = -1;
+
+/* the comparison functions get pointers to item, the first member */
+struct db_order {
+	list_item item;
+	int pos;
+};
+
+static void
+db_sort(int (*cmp)(const void *, const void *))
+{
+	struct db_order *order = xmalloc(sizeof(*order) * max(items, 1));
+	int i, *pos = xmalloc(sizeof(int) * max(items, 1));
+
+	for(i = 0; i < items; i++) {
+		order[i].item = database[i];
+		order[i].pos = i;
+	}
+
+	qsort(order, items, sizeof(*order), cmp);
+
+	for(i = 0; i < items; i++) {
+		database[i] = order[i].item;
+		pos[i] = order[i].pos;
+	}
+	free(order);
+
+	journal_add(JOURNAL_ORDER, 0, items, NULL, NULL, pos);
+	db_set_all_dirty();
+	db_need_save = TRUE;
+}
+
+static int
+namecmp(const void *i1, const void *i2)
+{
+	char *n1, *n2;
+
+	assert(sort_field >= 0 && sort_field < fields_count);
+
+	n1 = (*(list_item *)i1)[sort_field];
+	n2 = (*(list_item *)i2)[sort_field];
+
+	return safe_strcoll(n1, n2);
+}
+
+void
+sort_by_field(char *name)
+{
+	int field;
+
+	select_none();
+
+	name = (name == NULL) ? opt_get_str(STR_SORT_FIELD) : name;
+	find_field_number(name, &field);
+
+	if(field < 0) {
+		if(name == opt_get_str(STR_SORT_FIELD))
+			statusline_msg(_("Invalid field value defined "
+				"in configuration"));
+		else
+			statusline_msg(_("Invalid field value for sorting"));
+
+		return;
+	}
+
+	sort_field = field;
+
+	db_sort(namecmp);
+
+	refresh_screen();
+}
+
+void
+sort_surname()
+{
+	select_none();
+
+	db_sort(surnamecmp);
+
+	refresh_screen();
+}
+
+/* TODO implement a search based on more sophisticated patterns */
+int
+find_item(char *str, int start, int search_fields[])
+{
+	int i, id;
+	char *findstr = NULL;
+	char *tmp = NULL;
+	int ret = -1; /* not found */
+	struct db_enumerator e = init_db_enumerator(ENUM_ALL);
+
+	if(list_is_empty() || !is_valid_item(start))
+		return -2; /* error */
+
+	findstr = xstrdup(str);
+	findstr = strlower(findstr);
+
+	e.item = start - 1; /* must be "real start" - 1 */
+	db_enumerate_items(e) {
+		for(i = 0; search_fields[i] >= 0; i++) {
+			if((id = field_id(search_fields[i])) == -1)
+				continue;
+			if(database[e.item][id] == NULL)
+				continue;
+			tmp = xstrdup(database[e.item][id]);
+			if( tmp && strstr(strlower(tmp), findstr) ) {
+				ret = e.item;
+				goto out;
+			}
+			xfree(tmp);
+		}
+	}
+
+out:
+	free(findstr);
+	free(tmp);
+	return ret;
+}
+
+static int (*shown_func) (int item) = NULL;
+
+/*
+ * Sets what tells the items shown by the user interface apart, for
+ * ENUM_SHOWN and find_item_incremental(). A NULL func shows them all.
+ */
+void
+db_set_shown(int (*func) (int item))
+{
+	shown_func = func;
+}
+
+static int
+db_item_shown(int item)
+{
+	return !shown_func || (*shown_func) (item);
+}
+
+/*
+ * Incremental search: the matches of each query typed so far, so that a
+ * longer query only needs to look through the matches of a shorter one
+ */
+struct find_level {
+	char *str;
+	int *items;
+	int n;
+};
+
+static struct find_level *find_levels = NULL;
+static int find_depth = 0;
+
+/* strcasestr() for str, skipping to the bytes in first */
+static int
+find_str_matches(const char *s, const char *str, size_t len,
+		const char *first)
+{
+	for(; (s = strpbrk(s, first)) != NULL; s++)
+		if(!strncasecmp(s, str, len))
+			return TRUE;
+
+	return FALSE;
+}
+
+static int
+find_item_matches(int item, char *str, size_t len, const char *first,
+		int ids[])
+{
+	int i;
+
+	for(i = 0; ids[i] >= 0; i++)
+		if(database[item][ids[i]] && find_str_matches(
+					database[item][ids[i]], str, len, first))
+			return TRUE;
+
+	return FALSE;
+}
+
+/*
+ * Puts the items matching str into res, looking through from[0..n-1]
+ * or through all the items if from is NULL. Returns their number.
+ */
+static int
+find_items_in(char *str, int search_fields[], int *from, int n, int *res)
+{
+	size_t len = strlen(str);
+	char first[3];
+	int i, count = 0, *ids;
+
+	first[0] = tolower((unsigned char)*str);
+	first[1] = toupper((unsigned char)*str);
+	first[2] = 0;
+
+	for(i = 0; search_fields[i] >= 0; i++)
+		;
+	ids = xmalloc(sizeof(int) * (i + 1));
+	for(i = 0; *search_fields >= 0; search_fields++)
+		if((ids[i] = field_id(*search_fields)) != -1)
+			i++;
+	ids[i] = -1;
+
+	if(from) {
+		for(i = 0; i < n; i++)
+			if(find_item_matches(from[i], str, len, first, ids))
+				res[count++] = from[i];
+	} else {
+		for(i = 0; i < items; i++)
+			if(find_item_matches(i, str, len, first, ids))
+				res[count++] = i;
+	}
+
+	free(ids);
+
+	return count;
+}
+
+/* puts the items matching str like in find_item() into res */
+int
+find_items(char *str, int search_fields[], int *res)
+{
+	return find_items_in(str, search_fields, NULL, 0, res);
+}
+
+static void
+find_level_push(char *str, int search_fields[])
+{
+	struct find_level *l, *prev;
+
+	find_levels = xrealloc(find_levels,
+			sizeof(struct find_level) * (find_depth + 1));
+	prev = find_depth ? &find_levels[find_depth - 1] : NULL;
+	l = &find_levels[find_depth++];
+	l->str = xstrdup(str);
+	l->items = xmalloc(sizeof(int) * max(prev ? prev->n : items, 1));
+	l->n = find_items_in(str, search_fields, prev ? prev->items : NULL,
+			prev ? prev->n : 0, l->items);
+}
+
+static void
+find_level_pop()
+{
+	find_depth--;
+	free(find_levels[find_depth].str);
+	free(find_levels[find_depth].items);
+}
+
+/*
+ * Finds the first item from start on (wrapping around) that matches str
+ * like find_item() does and that is shown, see db_set_shown(). Meant to
+ * be called for each change of the search string until
+ * find_item_incremental_end().
+ */
+int
+find_item_incremental(char *str, int start, int search_fields[])
+{
+	int *res, n, lo, hi, mid, i;
+
+	if(list_is_empty() || !(n = find_items_incremental(str, search_fields,
+					&res)))
+		return -1;
+
+	for(lo = 0, hi = n; lo < hi; ) {
+		mid = (lo + hi) / 2;
+		if(res[mid] < start)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	/* the first match the list shows */
+	for(i = 0; i < n; i++)
+		if(db_item_shown(res[(lo + i) % n]))
+			return res[(lo + i) % n];
+
+	return -1;
+}
+
+/*
+ * Points res to the items matching str, which stay valid until the next
+ * call or find_item_incremental_end(). Returns their number.
+ */
+int
+find_items_incremental(char *str, int search_fields[], int **res)
+{
+	while(find_depth &&
+			!strcasestr(str, find_levels[find_depth - 1].str))
+		find_level_pop();
+
+	if(!find_depth || strcasecmp(str, find_levels[find_depth - 1].str))
+		find_level_push(str, search_fields);
+
+	*res = find_levels[find_depth - 1].items;
+
+	return find_levels[find_depth - 1].n;
+}
+
+void
+find_item_incremental_end()
+{
+	while(find_depth)
+		find_level_pop();
+
+	xfree(find_levels);
+}
+
+/*
+ * Completion: the names, nicks and addresses of the items, sorted
+ * regardless of case for a prefix to be looked up by bisection. Each
+ * entry carries a hash of the values of its item, so that an update
+ * only needs to sort in the values of the items that changed.
+ */
+struct complete_entry {
+	char *str;
+	int field;
+	unsigned long long tag;
+};
+
+static struct complete_entry *complete_entries = NULL;
+static int complete_n = 0;
+static unsigned long long *complete_item_tags = NULL; /* by item */
+static unsigned long long *complete_tags = NULL; /* the same, sorted */
+static int complete_items = 0;
+
+static const int complete_fields[] = { NAME, NICK, EMAIL, -1 };
+
+static int
+complete_entrycmp(const void *a, const void *b)
+{
+	const struct complete_entry *x = a, *y = b;
+	int ret;
+
+	if((ret = strcasecmp(x->str, y->str)) || (ret = strcmp(x->str, y->str)))
+		return ret;
+
+	if(x->field != y->field)
+		return x->field - y->field;
+
+	return (x->tag > y->tag) - (x->tag < y->tag);
 }
 
-int
-add_item2database(list_item item)
+static int
+complete_tagcmp(const void *a, const void *b)
 {
-	/* 'name' field is mandatory */
-	if((item[field_id(NAME)] == NULL) || ! *item[field_id(NAME)]) {
-		item_empty(item);
-		return 1;
-	}
+	unsigned long long x = *(unsigned long long *)a;
+	unsigned long long y = *(unsigned long long *)b;
 
-	if(++items > list_capacity)
-		adjust_list_capacity();
+	return (x > y) - (x < y);
+}
 
-	validate_item(item);
+static int
+complete_has_tag(unsigned long long *tags, int n, unsigned long long tag)
+{
+	return n && bsearch(&tag, tags, n, sizeof(tag), complete_tagcmp);
+}
 
-	selected[LAST_ITEM] = 0;
+static unsigned long long
+complete_item_tag(int item)
+{
+	unsigned long long h = 0;
+	int i, id;
 
-	database[LAST_ITEM] = item_create();
-        item_copy(database[LAST_ITEM], item);
-	db_need_save = TRUE;
+	for(i = 0; complete_fields[i] >= 0; i++)
+		if((id = field_id(complete_fields[i])) != -1 &&
+				database[item][id]) {
+			h = hash_add(h, &i, sizeof(i));
+			h = hash_str(h, database[item][id]);
+		}
 
-	return 0;
+	return h;
 }
 
-
-void
-remove_selected_items()
+static void
+complete_add(struct complete_entry **e, int *n, int *size, char *str,
+		int field, unsigned long long tag)
 {
-	int i, j;
+	if(*n == *size)
+		*e = xrealloc(*e, sizeof(**e) * (*size = *size ? 2 * *size : 64));
 
-	if(list_is_empty())
-		return;
+	(*e)[*n].str = str;
+	(*e)[*n].field = field;
+	(*e)[*n].tag = tag;
+	(*n)++;
+}
 
-	if(!selected_items())
-		selected[curitem] = 1;
+static void
+complete_add_item(struct complete_entry **e, int *n, int *size, int item,
+		unsigned long long tag)
+{
+	struct db_email_iter it;
+	int i, id;
 
-	for(j = LAST_ITEM; j >= 0; j--) {
-		if(selected[j]) {
-			db_free_item(j); /* added for .4 data_s_ */
-			for(i = j; i < LAST_ITEM; i++) {
-				item_copy(database[i], database[i + 1]);
-				selected[i] = selected[i + 1];
-			}
-			item_free(&database[LAST_ITEM]);
-			items--;
-			db_need_save = TRUE;
+	for(i = 0; complete_fields[i] >= 0; i++) {
+		if((id = field_id(complete_fields[i])) == -1 ||
+				!database[item][id] || !*database[item][id])
+			continue;
+		if(complete_fields[i] != EMAIL) {
+			complete_add(e, n, size, xstrdup(database[item][id]),
+					complete_fields[i], tag);
+			continue;
 		}
+		it = init_email_iter(database[item][id]);
+		db_enumerate_emails(it)
+			complete_add(e, n, size, xstrndup(it.email, it.len),
+					EMAIL, tag);
 	}
+}
 
-	if(curitem > LAST_ITEM && items > 0)
-		curitem = LAST_ITEM;
+/* puts the tags of a missing from b into res once, a and b being sorted */
+static int
+complete_tags_missing(unsigned long long *a, int na, unsigned long long *b,
+		int nb, unsigned long long *res)
+{
+	int i, j, n = 0;
 
-	adjust_list_capacity();
+	for(i = j = 0; i < na; i++) {
+		while(j < nb && b[j] < a[i])
+			j++;
+		if((j == nb || b[j] != a[i]) && (!n || res[n - 1] != a[i]))
+			res[n++] = a[i];
+	}
 
-	select_none();
+	return n;
 }
 
-void merge_selected_items()
+/*
+ * Sorts the tags of the items, patching the ones of before if only a
+ * few items changed in place
+ */
+static unsigned long long *
+complete_sort_tags(unsigned long long *item_tags)
 {
-	int i, j;
-	int destitem = -1;
+	unsigned long long *tags, *old, *new;
+	int i, j, k, n, changed = 0;
 
-	if((list_is_empty()) || (selected_items() < 2))
-		return;
+	tags = xmalloc(sizeof(*tags) * max(items, 1));
 
-	/* Find the top item */
-	for(j=0; destitem < 0; j++)
-		if(selected[j])
-			destitem = j;
+	if(complete_items == items)
+		for(i = 0; i < items; i++)
+			changed += item_tags[i] != complete_item_tags[i];
 
-	/* Merge pairwise */
-	for(j = LAST_ITEM; j > destitem; j--) {
-		if(selected[j]) {
-			item_merge(database[destitem],database[j]);
-			for(i = j; i < LAST_ITEM; i++) {
-				/* TODO: this can be done by moving pointers */
-				item_copy(database[i], database[i + 1]);
-				selected[i] = selected[i + 1];
-			}
-			item_free(&database[LAST_ITEM]);
-			items--;
-			db_need_save = TRUE;
-		}
+	if(complete_items != items || changed > items / 16) {
+		memcpy(tags, item_tags, sizeof(*tags) * items);
+		qsort(tags, items, sizeof(*tags), complete_tagcmp);
+		return tags;
 	}
 
-	if(curitem > LAST_ITEM && items > 0)
-		curitem = LAST_ITEM;
+	old = xmalloc(sizeof(*old) * changed);
+	new = xmalloc(sizeof(*new) * changed);
+	for(i = j = 0; i < items; i++)
+		if(item_tags[i] != complete_item_tags[i]) {
+			old[j] = complete_item_tags[i];
+			new[j++] = item_tags[i];
+		}
+	qsort(old, changed, sizeof(*old), complete_tagcmp);
+	qsort(new, changed, sizeof(*new), complete_tagcmp);
+
+	/* old is a part of complete_tags, each of them drops one there */
+	for(i = j = k = n = 0; i < items || k < changed; ) {
+		if(i < items && j < changed && complete_tags[i] == old[j]) {
+			i++;
+			j++;
+		} else if(k == changed || (i < items &&
+					complete_tags[i] <= new[k]))
+			tags[n++] = complete_tags[i++];
+		else
+			tags[n++] = new[k++];
+	}
 
-	adjust_list_capacity();
+	free(old);
+	free(new);
 
-	select_none();
+	return tags;
 }
 
-void remove_duplicates()
+/* brings the entries up to date with the items */
+static void
+complete_update()
 {
-	int i,j,k;
-	char *tmpj;
-	if(list_is_empty())
+	struct complete_entry *add = NULL, *merged;
+	unsigned long long *item_tags, *tags, *gone, *fresh;
+	int i, j, n, n_add = 0, size = 0, n_gone, n_fresh;
+
+	item_tags = xmalloc(sizeof(*item_tags) * max(items, 1));
+	for(i = 0; i < items; i++)
+		item_tags[i] = complete_item_tag(i);
+
+	if(complete_items == items && !memcmp(complete_item_tags, item_tags,
+				sizeof(*item_tags) * items)) {
+		free(item_tags);
 		return;
+	}
 
-	/* Scan from the last one */
-	for(j = LAST_ITEM - 1; j >= 0; j--) {
-		tmpj = db_name_get(j);
-		for(i = LAST_ITEM; i > j; i--)
-			/* Check name and merge if dups */
-			if (0 == strcmp(tmpj,db_name_get(i))) {
-				item_merge(database[j],database[i]);
-				if (curitem == i) curitem--;
-				for(k = i; k < LAST_ITEM; k++) {
-					item_copy(database[k], database[k + 1]);
-				}
-				item_free(&database[LAST_ITEM]);
-				items--;
-				db_need_save = TRUE;
-			}
+	tags = complete_sort_tags(item_tags);
+
+	gone = xmalloc(sizeof(*gone) * max(complete_items, 1));
+	n_gone = complete_tags_missing(complete_tags, complete_items,
+			tags, items, gone);
+	fresh = xmalloc(sizeof(*fresh) * max(items, 1));
+	n_fresh = complete_tags_missing(tags, items,
+			complete_tags, complete_items, fresh);
+
+	/* the values of the items which were not there before */
+	for(i = 0; n_fresh && i < items; i++)
+		if(complete_has_tag(fresh, n_fresh, item_tags[i]))
+			complete_add_item(&add, &n_add, &size, i, item_tags[i]);
+
+	qsort(add, n_add, sizeof(*add), complete_entrycmp);
+	for(i = j = 0; i < n_add; i++)
+		if(j && !complete_entrycmp(&add[j - 1], &add[i]))
+			free(add[i].str);
+		else
+			add[j++] = add[i];
+	n_add = j;
+
+	/* drops the entries of the items gone, merging the new ones in */
+	if(n_gone || n_add) {
+		merged = xmalloc(sizeof(*merged) * max(complete_n + n_add, 1));
+		for(i = j = n = 0; i < complete_n || j < n_add; ) {
+			if(i < complete_n && complete_has_tag(gone, n_gone,
+						complete_entries[i].tag))
+				free(complete_entries[i++].str);
+			else if(j >= n_add || (i < complete_n &&
+					complete_entrycmp(&complete_entries[i],
+						&add[j]) < 0))
+				merged[n++] = complete_entries[i++];
+			else
+				merged[n++] = add[j++];
+		}
+		free(complete_entries);
+		complete_entries = merged;
+		complete_n = n;
 	}
 
-	adjust_list_capacity();
-}
+	free(add);
+	free(gone);
+	free(fresh);
+	free(complete_item_tags);
+	free(complete_tags);
 
+	complete_item_tags = item_tags;
+	complete_tags = tags;
+	complete_items = items;
+}
 
+/*
+ * Returns the values of the fields of search_fields (NAME, NICK and
+ * EMAIL) which start with prefix regardless of case, one at a time and
+ * each value once. *pos is to be -1 for the first call and kept for the
+ * following ones. The values stay valid until the next first call.
+ */
 char *
-get_surname(char *s)
+db_complete(const char *prefix, int search_fields[], int *pos)
 {
-	char *p = s + strlen(s);
-
-	assert(s != NULL);
-
-	while(p > s && *(p - 1) != ' ')
-		p--;
+	size_t len = strlen(prefix);
+	struct complete_entry *e;
+	int lo, hi, mid, i;
+	char *last;
+
+	if(*pos < 0) {
+		complete_update();
+		for(lo = 0, hi = complete_n; lo < hi; ) {
+			mid = (lo + hi) / 2;
+			if(strncasecmp(complete_entries[mid].str, prefix,
+						len) < 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		*pos = lo;
+	} else if(*pos < complete_n)
+		for(last = complete_entries[(*pos)++].str; *pos < complete_n &&
+				!strcmp(complete_entries[*pos].str, last);
+				(*pos)++)
+			;
+
+	for(; *pos < complete_n; (*pos)++) {
+		e = &complete_entries[*pos];
+		if(strncasecmp(e->str, prefix, len))
+			break;
+		for(i = 0; search_fields[i] >= 0; i++)
+			if(search_fields[i] == e->field)
+				return e->str;
+	}
 
-	return xstrdup(p);
+	return NULL;
 }
 
-static int
-surnamecmp(const void *i1, const void *i2)
+void
+db_complete_free()
 {
-	int ret, idx = field_id(NAME);
-	char *n1, *n2, *s1, *s2;
+	int i;
 
-	n1 = (*(list_item *)i1)[idx];
-	n2 = (*(list_item *)i2)[idx];
+	for(i = 0; i < complete_n; i++)
+		free(complete_entries[i].str);
 
-	s1 = get_surname(n1);
-	s2 = get_surname(n2);
+	xfree(complete_entries);
+	xfree(complete_item_tags);
+	xfree(complete_tags);
+	complete_n = complete_items = 0;
+}
 
-	if( !(ret = safe_strcoll(s1, s2)) )
-		ret = safe_strcoll(n1, n2);
+/* adds the fields of an item to the hash h */
+unsigned long long
+db_item_hash(int item, unsigned long long h)
+{
+	int i;
 
-	free(s1);
-	free(s2);
+	for(i = 0; i < fields_count; i++)
+		if(database[item][i]) {
+			h = hash_add(h, &i, sizeof(i));
+			h = hash_str(h, database[item][i]);
+		}
 
-	return ret;
+	return h;
 }
 
-static int sort_field = -1;
-
-static int
-namecmp(const void *i1, const void *i2)
+/*
+ * Export projection: only the fields ids[0..count-1] are handed out
+ * by db_fget(), the e-mail functions and write_database().
+ */
+void
+db_set_projection(int *ids, int count)
 {
-	char *n1, *n2;
+	int i;
 
-	assert(sort_field >= 0 && sort_field < fields_count);
+	xfree(projection);
+	xfree(projection_mask);
 
-	n1 = (*(list_item *)i1)[sort_field];
-	n2 = (*(list_item *)i2)[sort_field];
+	projection = xmalloc(sizeof(int) * max(count, 1));
+	memcpy(projection, ids, sizeof(int) * count);
+	projection_count = count;
 
-	return safe_strcoll(n1, n2);
+	/* fields declared later on are not part of the projection */
+	projection_mask_size = fields_count;
+	projection_mask = xmalloc0(max(fields_count, 1));
+	for(i = 0; i < count; i++) {
+		assert(ids[i] >= 0 && ids[i] < fields_count);
+		projection_mask[ids[i]] = 1;
+	}
 }
 
-void
-sort_by_field(char *name)
+/* returns the number of projected fields, or -1 if all are exported */
+int
+db_get_projection(int **ids)
 {
-	int field;
+	if(!projection_mask)
+		return -1;
 
-	select_none();
+	*ids = projection;
+	return projection_count;
+}
 
-	name = (name == NULL) ? opt_get_str(STR_SORT_FIELD) : name;
-	find_field_number(name, &field);
+/*
+ * Export conditions, all of them have to match (see ENUM_WHERE):
+ *	field		the field is not empty
+ *	field=value	the field, or one of the elements of an e-mail
+ *			or list field, is value
+ *	field~value	the field contains value
+ * Comparisons ignore case, a leading '!' negates a condition.
+ */
+enum { COND_SET, COND_EQUAL, COND_CONTAINS };
 
-	if(field < 0) {
-		if(name == opt_get_str(STR_SORT_FIELD))
-			statusline_msg(_("Invalid field value defined "
-				"in configuration"));
-		else
-			statusline_msg(_("Invalid field value for sorting"));
+struct db_condition {
+	int field;
+	int op;
+	int negate;
+	int list;
+	char *value;
+	struct db_condition *next;
+};
 
-		return;
-	}
+static struct db_condition *conditions = NULL;
 
-	sort_field = field;
+char *
+db_add_condition(char *s)
+{
+	struct db_condition *c, **last;
+	abook_field *f;
+	char *key, *p;
+	int field, negate = 0, op = COND_SET;
 
-	qsort((void *)database, items, sizeof(list_item), namecmp);
-	db_need_save = TRUE;
+	if(*s == '!') {
+		negate = 1;
+		s++;
+	}
 
-	refresh_screen();
-}
+	key = xstrdup(s);
+	if((p = strpbrk(key, "=~"))) {
+		op = (*p == '=') ? COND_EQUAL : COND_CONTAINS;
+		*p++ = 0;
+	}
 
-void
-sort_surname()
-{
-	select_none();
+	if(!(f = find_field_number(key, &field))) {
+		free(key);
+		return _("unknown field");
+	}
 
-	qsort((void *)database, items, sizeof(list_item), surnamecmp);
-	db_need_save = TRUE;
+	c = xmalloc(sizeof(struct db_condition));
+	c->field = field;
+	c->op = op;
+	c->negate = negate;
+	c->list = (f->type == FIELD_EMAILS || f->type == FIELD_LIST);
+	c->value = xstrdup(p ? p : "");
+	c->next = NULL;
+	free(key);
 
-	refresh_screen();
+	for(last = &conditions; *last; last = &(*last)->next)
+		;
+	*last = c;
+
+	return NULL;
 }
 
-/* TODO implement a search based on more sophisticated patterns */
-int
-find_item(char *str, int start, int search_fields[])
+static int
+db_condition_matches(struct db_condition *c, char *val)
 {
-	int i, id;
-	char *findstr = NULL;
-	char *tmp = NULL;
-	int ret = -1; /* not found */
-	struct db_enumerator e = init_db_enumerator(ENUM_ALL);
-
-	if(list_is_empty() || !is_valid_item(start))
-		return -2; /* error */
+	struct db_email_iter it;
+	size_t len;
 
-	findstr = xstrdup(str);
-	findstr = strlower(findstr);
+	if(!val)
+		val = "";
 
-	e.item = start - 1; /* must be "real start" - 1 */
-	db_enumerate_items(e) {
-		for(i = 0; search_fields[i] >= 0; i++) {
-			if((id = field_id(search_fields[i])) == -1)
-				continue;
-			if(database[e.item][id] == NULL)
-				continue;
-			tmp = xstrdup(database[e.item][id]);
-			if( tmp && strstr(strlower(tmp), findstr) ) {
-				ret = e.item;
-				goto out;
-			}
-			xfree(tmp);
-		}
+	switch(c->op) {
+		case COND_SET:
+			return *val != 0;
+		case COND_CONTAINS:
+			return strcasestr(val, c->value) != NULL;
 	}
 
-out:
-	free(findstr);
-	free(tmp);
-	return ret;
+	if(!c->list || !*c->value)
+		return !strcasecmp(val, c->value);
+
+	len = strlen(c->value);
+	it = init_email_iter(val);
+	db_enumerate_emails(it)
+		if(it.len == len && !strncasecmp(it.email, c->value, len))
+			return 1;
+
+	return 0;
 }
 
 int
-is_selected(int item)
+db_item_matches(int item)
 {
-	return selected[item];
+	struct db_condition *c;
+
+	for(c = conditions; c; c = c->next)
+		if(db_condition_matches(c, database[item][c->field]) ==
+				c->negate)
+			return 0;
+
+	return 1;
 }
 
 int
@@ -754,6 +2641,13 @@ db_n_items()
 	return items;
 }
 
+/* tells whether the items changed since an earlier call */
+unsigned int
+db_changes()
+{
+	return changes;
+}
+
 int
 real_db_enumerate_items(struct db_enumerator e)
 {
@@ -773,6 +2667,22 @@ real_db_enumerate_items(struct db_enumerator e)
 				}
 			}
 			return -1;
+		case ENUM_WHERE:
+			for(i = item; i <= LAST_ITEM; i++) {
+				if(db_item_matches(i)) {
+					item = i;
+					goto out;
+				}
+			}
+			return -1;
+		case ENUM_SHOWN:
+			for(i = item; i <= LAST_ITEM; i++) {
+				if(db_item_shown(i)) {
+					item = i;
+					goto out;
+				}
+			}
+			return -1;
 #ifdef DEBUG
 		default:
 			fprintf(stderr, "real_db_enumerate_items() "
@@ -926,8 +2836,7 @@ real_db_field_put(int item, int i, int std, char *val)
 	id = std ? field_id(i) : i;
 
 	if(id != -1) {
-		database[item][id] = val;
-		db_need_save = TRUE;
+		db_field_set(item, id, val);
 		return 1;
 	}
 
@@ -943,18 +2852,96 @@ real_db_field_get(int item, int i, int std)
 
 	id = std ? field_id(i) : i;
 
-	if(id != -1)
+	if(id != -1 && field_shown(id))
 		return database[item][id];
 	else
 		return NULL;
 }
 
+/* the name identifies the item, which the projection does not hide */
+char *
+db_name_get(int item)
+{
+	assert(database[item]);
+
+	return database[item][field_id(NAME)];
+}
+
+/* the item must not be changed through the returned pointer, which the
+   undo journal could not follow: see db_fput() */
 list_item
 db_item_get(int i)
 {
 	return database[i];
 }
 
+struct db_email_iter
+init_db_email_iter(int item)
+{
+	struct db_email_iter it;
+
+	it.item = item;
+	it.field = 0;
+	it.cur = fields_list;
+	it.p = it.email = NULL;
+	it.len = 0;
+
+	return it;
+}
+
+struct db_email_iter
+init_email_iter(char *str)
+{
+	struct db_email_iter it = init_db_email_iter(-1);
+
+	it.cur = NULL;
+	it.p = str ? str : "";
+
+	return it;
+}
+
+/*
+ * Addresses are separated by commas, leading whitespace and trailing
+ * spaces are dropped, as in csv_to_abook_list().
+ */
+int
+db_email_iter_next(struct db_email_iter *it)
+{
+	char *end;
+
+	for(;;) {
+		while(!it->p || !*it->p) { /* next field */
+			if(it->item < 0)
+				return 0;
+			if(it->p) {
+				it->cur = it->cur->next;
+				it->field++;
+			}
+			for(; it->cur; it->cur = it->cur->next, it->field++)
+				if(it->cur->field->type == FIELD_EMAILS &&
+						database[it->item][it->field] &&
+						field_shown(it->field))
+					break;
+			if(!it->cur)
+				return 0;
+			it->p = database[it->item][it->field];
+		}
+
+		SKIPWS(it->p);
+		it->email = end = it->p;
+		for(; *it->p && *it->p != ','; it->p++)
+			if(*it->p != ' ')
+				end = it->p + 1;
+		if(*it->p)
+			it->p++;
+
+		if(end > it->email) {
+			it->len = end - it->email;
+			return 1;
+		}
+	}
+}
+
 /* Fetch addresses from all fields of FIELD_EMAILS type */
 /* Memory has to be freed by the caller */
 char *
@@ -966,7 +2953,8 @@ db_email_get(int item)
 	abook_list *emails = NULL;
 
 	for(cur = fields_list, i = 0; cur; cur = cur->next, i++)
-		if(cur->field->type == FIELD_EMAILS && *database[item][i])
+		if(cur->field->type == FIELD_EMAILS && *database[item][i] &&
+				field_shown(i))
 			abook_list_append(&emails, database[item][i]);
 
 	res = abook_list_to_csv(emails);
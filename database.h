@@ -1,6 +1,8 @@
 #ifndef _DATABASE_H
 #define _DATABASE_H
 
+#include <pthread.h>
+
 #define MAX_LIST_ITEMS		9
 #define MAX_EMAIL_LEN		80
 #define MAX_EMAILSTR_LEN	(MAX_LIST_ITEMS * (MAX_EMAIL_LEN + 1) + 1)
@@ -49,7 +51,9 @@ enum {
 
 enum {
 	ENUM_ALL,
-	ENUM_SELECTED
+	ENUM_SELECTED,
+	ENUM_WHERE,	/* items matching the conditions, see db_add_condition() */
+	ENUM_SHOWN	/* items shown by the list, see db_set_shown() */
 };
 
 struct db_enumerator {
@@ -57,6 +61,17 @@ struct db_enumerator {
 	int mode; /* warning: read only */
 };
 
+/*
+ * A batch collects the items added by one thread (see db_batch_redirect())
+ * apart from the database, until they are committed in one go.
+ */
+struct db_batch {
+	list_item *items;
+	int count;
+	int capacity;
+	pthread_mutex_t *lock;	/* held to change count, if not NULL */
+};
+
 
 /*
  * Field operations
@@ -78,8 +93,12 @@ void init_standard_fields();
 void prepare_database_internals();
 int parse_database(FILE *in);
 int load_database(char *filename);
+void write_database_head(FILE *out);
+void write_database_item(FILE *out, int item, int n);
 int write_database(FILE *out, struct db_enumerator e);
 int save_database(int force_save);
+void save_database_background();
+int save_database_finish(int wait);
 void remove_selected_items();
 void merge_selected_items();
 void remove_duplicates();
@@ -87,18 +106,74 @@ void sort_surname();
 void sort_by_field(char *field);
 void close_database();
 int add_item2database(list_item item);
+int db_adopt_item(list_item item);
 char *get_surname(char *s);
 int find_item(char *str, int start, int search_fields[]);
+int find_items(char *str, int search_fields[], int *res);
+int find_item_incremental(char *str, int start, int search_fields[]);
+int find_items_incremental(char *str, int search_fields[], int **res);
+void find_item_incremental_end();
+char *db_complete(const char *prefix, int search_fields[], int *pos);
+void db_complete_free();
+unsigned long long db_item_hash(int item, unsigned long long h);
 int is_selected(int item);
+void db_select_item(int item, int value);
+void db_select_all(int value);
+void db_invert_selection();
+int db_selected_count();
 int is_valid_item(int item);
 int last_item();
 int db_n_items();
+unsigned int db_changes();
+
+/*
+ * undo journal
+ */
+void db_journal_step();
+int db_undo(int *item);
+int db_redo(int *item);
+void db_swap_items(int a, int b);
+
+/*
+ * Export time projection and filtering
+ */
+void db_set_projection(int *ids, int count);
+int db_get_projection(int **ids);
+char *db_add_condition(char *s);
+int db_item_matches(int item);
+
+void db_batch_init(struct db_batch *b);
+void db_batch_redirect(struct db_batch *b);
+int db_batch_commit(struct db_batch *b);
+void db_batch_free(struct db_batch *b);
+void db_stream_redirect(void (*func) (int item, void *data), void *data);
+void db_set_shown(int (*func) (int item));
 
 int real_db_enumerate_items(struct db_enumerator e);
 struct db_enumerator init_db_enumerator(int mode);
 #define db_enumerate_items(e) \
 	while( -1 != (e.item = real_db_enumerate_items(e)))
 
+/*
+ * Walks through the addresses of all FIELD_EMAILS fields of an item,
+ * or of a comma separated string. email points into the data and is
+ * not NUL-terminated.
+ */
+struct db_email_iter {
+	int item;	/* -1 for a string */
+	int field;
+	abook_field_list *cur;
+	char *p;
+	char *email;
+	int len;
+};
+
+struct db_email_iter init_db_email_iter(int item);
+struct db_email_iter init_email_iter(char *str);
+int db_email_iter_next(struct db_email_iter *it);
+#define db_enumerate_emails(it) \
+	while(db_email_iter_next(&(it)))
+
 /*
  * item manipulation
  */
@@ -118,11 +193,11 @@ char *item_fget(list_item item, int i);
 char *real_db_field_get(int item, int i, int std);
 #define db_fget(item, i)		real_db_field_get(item, i, 1)
 #define db_fget_byid(item, i)		real_db_field_get(item, i, 0)
-#define db_name_get(item)		db_fget(item, NAME)
+char *db_name_get(int item);
 char *db_email_get(int item); /* memory has to be freed by the caller */
 
 /*
- * database field write
+ * database field write, the old value is freed
  */
 int real_db_field_put(int item, int i, int std, char *val);
 #define db_fput(item, i, val) \
@@ -39,6 +39,10 @@ extern bool db_need_save;
 
 WINDOW *editw;
 
+/* the values completing names and addresses, see db_complete() */
+static int name_fields[] = { NAME, -1 };
+static int email_fields[] = { EMAIL, -1 };
+
 
 static void
 editor_tab(const int tab)
@@ -111,7 +115,6 @@ roll_emails(int item, enum rotate_dir dir)
 	if(!emails)
 		return;
 
-	free(db_fget(item, EMAIL));
 	abook_list_rotate(&emails, dir);
 	db_fput(item, EMAIL, abook_list_to_csv(emails));
 	abook_list_free(&emails);
@@ -127,52 +130,24 @@ init_editor()
 	refresh_statusline();
 }
 
-enum {
-	BACKUP_ITEM,
-	RESTORE_ITEM,
-	CLEAR_UNDO
-};
-
+/* returns the item to show after it, -1 to leave the editor */
 static int
-edit_undo(int item, int mode)
+edit_undo(int item, int redo)
 {
-	static list_item backup = NULL;
-	static int backed_up_item = -1;
-
-	switch(mode) {
-		case CLEAR_UNDO:
-			if(backup) {
-				item_empty(backup);
-				item_free(&backup);
-			}
-			break;
-		case BACKUP_ITEM:
-			if(backup) {
-				item_empty(backup);
-				item_free(&backup);
-			}
-			backup = item_create();
-			item_duplicate(backup, db_item_get(item));
-			backed_up_item = item;
-			break;
-		case RESTORE_ITEM:
-			if(backup) {
-				item_empty(db_item_get(backed_up_item));
-				item_copy(db_item_get(backed_up_item), backup);
-				item_free(&backup);
-				return backed_up_item;
-			}
-			break;
-		default:
-			assert(0);
-	}
-	return item;
+	int changed;
+
+	if(!(redo ? db_redo(&changed) : db_undo(&changed)))
+		return item;
+
+	if(changed >= 0)
+		return changed;
+
+	return is_valid_item(item) ? item : -1;
 }
 
 static void
 close_editor()
 {
-	edit_undo(-1, CLEAR_UNDO);
 	delwin(editw);
 	refresh_screen();
 }
@@ -287,20 +262,22 @@ editor_print_data(int tab, int item)
  *   pointer != NULL it will be freed (if user doesn't cancel)
  *  (size_t max_len)
  *   maximum length of field to read from user
+ *  (int complete_fields[])
+ *   the fields whose values complete the string, or NULL
  *
  * returns (int)
  *  a nonzero value if user has cancelled and zero if user has typed a
  *  valid string
  */
 static int
-change_field(char *msg, char **field, size_t max_len)
+change_field(char *msg, char **field, size_t max_len, int complete_fields[])
 {
 	char *old;
 	int ret = 0;
 
 	old = *field;
 
-	*field = ui_readline(msg, old, max_len - 1, 0);
+	*field = ui_readline_fields(msg, old, max_len - 1, complete_fields);
 
 	if(*field) {
 		db_need_save = TRUE;
@@ -325,7 +302,7 @@ change_name_field(char *msg, char **field, size_t max_len)
 	int ret;
 
 	tmp = xstrdup(*field);
-	ret = change_field(msg, field, max_len);
+	ret = change_field(msg, field, max_len, name_fields);
 
 	if(*field == NULL || ! **field) {
 		xfree(*field);
@@ -383,8 +360,8 @@ edit_list(int item, int nb, int isemail)
 		xstrdup(abook_list_get(list, choice - 2)->data) :
 		NULL;
 
-	if(change_field(isemail ? _("E-mail: ") : _("Item: "),
-				&field, MAX_EMAIL_LEN))
+	if(change_field(isemail ? _("E-mail: ") : _("Item: "), &field,
+				MAX_EMAIL_LEN, isemail ? email_fields : NULL))
 		return; /* user cancelled ( C-g ) */
 
 	/* TODO if list item contains commas, should use quotes instead */
@@ -542,7 +519,7 @@ edit_date(int item, int nb)
 
 	for(i = 0; i < 3; i++) {
 		s = (old && date[i]) ? strdup_printf("%d", date[i]) : NULL;
-		if(change_field(gettext(field[i]), &s, 5))
+		if(change_field(gettext(field[i]), &s, 5, NULL))
 			return; /* user aborted with ^G */
 
 		date[i] = (s && is_number(s)) ? atoi(s) : 0;
@@ -590,15 +567,12 @@ edit_field(int tab, char c, int item_number)
 {
 	ui_enable_mouse(FALSE);
 	int i = 0, number, idx;
-	char *msg;
+	char *msg, *s;
 	abook_field_list *f;
-	list_item item;
 
 	if((number = key_to_field_number(c)) < 0)
 		goto detachfield;
 
-	edit_undo(item_number, BACKUP_ITEM);
-
 	view_info(tab, NULL, &f);
 
 	while(1) {
@@ -617,11 +591,14 @@ edit_field(int tab, char c, int item_number)
 	switch(f->field->type) {
 		case FIELD_STRING:
 			msg = strdup_printf("%s: ", f->field->name);
-			item = db_item_get(item_number);
-			if(strcmp(f->field->key, "name") == 0)
-				change_name_field(msg,&item[idx],MAX_FIELD_LEN);
+			s = db_fget_byid(item_number, idx);
+			s = s ? xstrdup(s) : NULL;
+			if(!(strcmp(f->field->key, "name") == 0 ?
+					change_name_field(msg,&s,MAX_FIELD_LEN) :
+					change_field(msg,&s,MAX_FIELD_LEN,NULL)))
+				db_fput_byid(item_number, idx, s);
 			else
-				change_field(msg,&item[idx],MAX_FIELD_LEN);
+				xfree(s);
 			free(msg);
 			break;
 		case FIELD_LIST:
@@ -660,6 +637,7 @@ edit_loop(int item)
 	wrefresh(editw);
 
 	c = getch();
+	db_journal_step(); /* each key is undone on its own */
 	if(c == '\033') {
 		statusline_addstr("ESC-");
 		c = getch();
@@ -738,7 +716,8 @@ edit_loop(int item)
 		case 'j': if(is_valid_item(item + 1)) item++; break;
 		case 'r': roll_emails(item, ROTATE_LEFT); break;
 		case '?': display_help(HELP_EDITOR); break;
-		case 'u': item = edit_undo(item, RESTORE_ITEM); break;
+		case 'u': item = edit_undo(item, FALSE); break;
+		case 18 : item = edit_undo(item, TRUE); break; /* ^R */
 		case 'm': launch_mutt(item); clearok(stdscr, 1); break;
 		case 'v': launch_wwwbrowser(item); clearok(stdscr, 1); break;
 		case 12 : clearok(stdscr, 1); break; /* ^L (refresh screen) */
@@ -773,7 +752,7 @@ add_item()
 	char *field = NULL;
 	list_item item = item_create();
 
-	change_field(_("Name: "), &field, MAX_FIELD_LEN);
+	change_field(_("Name: "), &field, MAX_FIELD_LEN, NULL);
 
 	if( field == NULL )
 		return;
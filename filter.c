@@ -11,8 +11,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <locale.h>
 #include <pwd.h>
+#include <pthread.h>
+#include <unistd.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include "abook_curses.h"
 #include "filter.h"
@@ -35,6 +40,12 @@ extern abook_field_list *fields_list;
 extern int fields_count;
 // see also enum field_types @database.h
 extern abook_field standard_fields[];
+extern char *datafile;
+
+// stores the format string from --outformatstr {custom_format}
+// (when "custom" output format is requested)
+// overrides default value of custom_format set by from abook.c
+extern char custom_format[FORMAT_STRING_LEN];
 
 /*
  * function declarations
@@ -51,6 +62,7 @@ static int 	csv_parse_file(FILE *in);
 static int 	allcsv_parse_file(FILE *in);
 static int 	palmcsv_parse_file(FILE *in);
 static int 	vcard_parse_file(FILE *in);
+static int	auto_parse_file(FILE *in);
 
 /*
  * export filter prototypes
@@ -80,6 +92,35 @@ void vcard_export_item(FILE *out, int item);
 void muttq_print_item(FILE *file, int item);
 void custom_print_item(FILE *out, int item);
 
+/*
+ * stream export filter prototypes
+ */
+
+static void	ldif_export_head(FILE *out);
+static void	ldif_export_item(FILE *out, int item, int n);
+static void	html_export_head(FILE *out);
+static void	html_export_item(FILE *out, int item, int n);
+static void	html_export_write_tail(FILE *out);
+static void	vcard_stream_item(FILE *out, int item, int n);
+static void	mutt_alias_export_item(FILE *out, int item, int n);
+static void	mutt_query_export_head(FILE *out);
+static void	mutt_query_export_item(FILE *out, int item, int n);
+static void	pine_export_item(FILE *out, int item, int n);
+static void	csv_export_item(FILE *out, int item, int n);
+static void	allcsv_export_head(FILE *out);
+static void	allcsv_export_item(FILE *out, int item, int n);
+static void	palm_export_item(FILE *out, int item, int n);
+static void	elm_alias_export_item(FILE *out, int item, int n);
+static void	text_export_head(FILE *out);
+static void	text_export_item(FILE *out, int item, int n);
+static void	text_export_tail(FILE *out);
+static void	wl_export_head(FILE *out);
+static void	wl_export_item(FILE *out, int item, int n);
+static void	wl_export_tail(FILE *out);
+static void	bsdcal_export_item(FILE *out, int item, int n);
+static void	custom_export_head(FILE *out);
+static void	custom_stream_item(FILE *out, int item, int n);
+
 /*
  * end of function declarations
  */
@@ -93,6 +134,7 @@ struct abook_input_filter i_filters[] = {
 	{ "allcsv", N_("comma separated values (all fields)"), allcsv_parse_file },
 	{ "palmcsv", N_("Palm comma separated values"), palmcsv_parse_file },
 	{ "vcard", N_("vCard file"), vcard_parse_file },
+	{ "auto", N_("guess the format from the contents"), auto_parse_file },
 	{ "\0", NULL, NULL }
 };
 
@@ -123,6 +165,30 @@ struct abook_output_item_filter u_filters[] = {
 	{ "\0", NULL }
 };
 
+/*
+ * Output filters writing each item on its own, without looking at the
+ * rest of the database. They produce the same output as their e_filters
+ * counterpart, one item at a time.
+ */
+struct abook_output_stream_filter s_filters[] = {
+	{ "abook", write_database_head, write_database_item, NULL },
+	{ "ldif", ldif_export_head, ldif_export_item, NULL },
+	{ "html", html_export_head, html_export_item, html_export_write_tail },
+	{ "vcard", NULL, vcard_stream_item, NULL },
+	{ "mutt", NULL, mutt_alias_export_item, NULL },
+	{ "muttq", mutt_query_export_head, mutt_query_export_item, NULL },
+	{ "pine", NULL, pine_export_item, NULL },
+	{ "csv", NULL, csv_export_item, NULL },
+	{ "allcsv", allcsv_export_head, allcsv_export_item, NULL },
+	{ "palmcsv", NULL, palm_export_item, NULL },
+	{ "elm", NULL, elm_alias_export_item, NULL },
+	{ "text", text_export_head, text_export_item, text_export_tail },
+	{ "wl", wl_export_head, wl_export_item, wl_export_tail },
+	{ "bsdcal", NULL, bsdcal_export_item, NULL },
+	{ "custom", custom_export_head, custom_stream_item, NULL },
+	{ "\0", NULL, NULL, NULL }
+};
+
 /*
  * common functions
  */
@@ -184,10 +250,14 @@ get_real_name()
 	int rtn;
 	char *tmp;
 
-	pwent = getpwnam(username);
+	pwent = username ? getpwnam(username) : getpwuid(getuid());
 
-	if((tmp = xstrdup(pwent->pw_gecos)) == NULL)
-		return xstrdup(username);
+	if(!pwent)
+		return xstrdup(safe_str(username));
+	if(!username)
+		username = pwent->pw_name;
+
+	tmp = xstrdup(pwent->pw_gecos);
 
 	rtn = sscanf(pwent->pw_gecos, "%[^,]", tmp);
 	if (rtn == EOF || rtn == 0) {
@@ -202,6 +272,8 @@ get_real_name()
  */
 
 static int		i_read_file(char *filename, int (*func) (FILE *in));
+static int		import_resizes_items(int filter);
+static int		import_async(int filter, char *filename);
 
 static void
 import_screen()
@@ -227,7 +299,7 @@ import_screen()
 int
 import_database()
 {
-	int filter;
+	int filter, ret;
 	char *filename;
 	int tmp = db_n_items();
 
@@ -248,7 +320,14 @@ import_database()
 		return 2;
 	}
 
-	if(i_read_file(filename, i_filters[filter].func ))
+	if(import_resizes_items(filter))
+		ret = i_read_file(filename, i_filters[filter].func);
+	else
+		ret = import_async(filter, filename);
+
+	if(ret == -1)
+		statusline_msg(_("Import cancelled"));
+	else if(ret)
 		statusline_msg(_("Error occured while opening the file"));
 	else if(tmp == db_n_items())
 		statusline_msg(_("File does not seem to be a valid addressbook"));
@@ -277,30 +356,30 @@ i_read_file(char *filename, int (*func) (FILE *in))
 	return ret;
 }
 
-int
-import_file(char filtname[FILTNAME_LEN], char *filename)
+static int
+find_input_filter(char filtname[FILTNAME_LEN])
 {
 	int i;
-	int tmp = db_n_items();
-	int ret = 0;
 
 	for(i=0;; i++) {
 		if(! strncasecmp(i_filters[i].filtname, filtname,
 					FILTNAME_LEN) )
-			break;
-		if(! *i_filters[i].filtname) {
-			i = -1;
-			break;
-		}
+			return i;
+		if(! *i_filters[i].filtname)
+			return -1;
 	}
+}
 
-	if(i < 0)
-		return -1;
+/* reads filename ("-" for stdin) with the input filter i */
+static int
+import_read(int i, char *filename)
+{
+	int ret = 0;
 
 #ifdef HAVE_VFORMAT
 	// this is a special case for
 	// libvformat whose API expects a filename
-	if(!strcmp(filtname, "vcard")) {
+	if(!strcmp(i_filters[i].filtname, "vcard")) {
 	  if(!strcmp(filename, "-"))
 	    ret = vcard_parse_file_libvformat("/dev/stdin");
 	  else
@@ -318,6 +397,21 @@ import_file(char filtname[FILTNAME_LEN], char *filename)
 	} else
 		ret =  i_read_file(filename, i_filters[i].func);
 
+	return ret;
+}
+
+int
+import_file(char filtname[FILTNAME_LEN], char *filename)
+{
+	int i;
+	int tmp = db_n_items();
+	int ret = 0;
+
+	if((i = find_input_filter(filtname)) < 0)
+		return -1;
+
+	ret = import_read(i, filename);
+
 	if(tmp == db_n_items())
 		ret = 1;
 
@@ -325,211 +419,1179 @@ import_file(char filtname[FILTNAME_LEN], char *filename)
 }
 
 /*
- * export
+ * Parsing an abook file may declare new fields, which resizes every item:
+ * only the items already in the database would follow, not the ones of
+ * a batch.
+ */
+static int
+import_resizes_items(int filter)
+{
+	return (!strcmp(i_filters[filter].filtname, "abook") ||
+			!strcmp(i_filters[filter].filtname, "auto")) &&
+		!strcasecmp(opt_get_str(STR_PRESERVE_FIELDS), "all");
+}
+
+/*
+ * import of several files at once
+ *
+ * Files are parsed concurrently, each one into its own batch, then the
+ * batches are committed to the database in the order of the files.
  */
 
-static int e_write_file(char *filename,
-		int (*func) (FILE *in, struct db_enumerator e), int mode);
+struct import_job {
+	char *filename;
+	struct db_batch batch;
+	int ret;
+	double elapsed;
+};
+
+struct import_pool {
+	struct import_job *jobs;
+	int n_jobs;
+	int next_job;
+	int done;
+	int filter;
+	pthread_mutex_t lock;
+};
+
+static double
+elapsed_since(struct timeval *start)
+{
+	struct timeval now, diff;
+
+	gettimeofday(&now, NULL);
+	timersub(&now, start, &diff);
+
+	return diff.tv_sec + diff.tv_usec / 1e6;
+}
 
 static void
-export_screen()
+import_report(int done, int total, char *filename, int n, double elapsed,
+		int failed)
 {
-	int i;
+	if(failed)
+		fprintf(stderr, _("[%d/%d] %s: cannot read file\n"),
+				done, total, filename);
+	else
+		fprintf(stderr, _("[%d/%d] %s: %d item(s) in %.3f s\n"),
+				done, total, filename, n, elapsed);
+}
 
-	clear();
+static void *
+import_worker(void *arg)
+{
+	struct import_pool *pool = arg;
+	struct import_job *job;
+	struct timeval start;
 
+	for(;;) {
+		pthread_mutex_lock(&pool->lock);
+		job = (pool->next_job < pool->n_jobs) ?
+			&pool->jobs[pool->next_job++] : NULL;
+		pthread_mutex_unlock(&pool->lock);
 
-	refresh_statusline();
-	headerline(_("export database"));
+		if(!job)
+			break;
 
-	mvaddstr(3, 1, _("please select a filter"));
+		gettimeofday(&start, NULL);
+		db_batch_redirect(&job->batch);
+		job->ret = import_read(pool->filter, job->filename);
+		db_batch_redirect(NULL);
+		job->elapsed = elapsed_since(&start);
 
+		if(!job->batch.count)
+			job->ret = 1;
 
-	for(i = 0; *e_filters[i].filtname ; i++)
-		mvprintw(5 + i, 6, "%c -\t%s\t%s\n", 'a' + i,
-			e_filters[i].filtname,
-			gettext(e_filters[i].desc));
+		pthread_mutex_lock(&pool->lock);
+		import_report(++pool->done, pool->n_jobs, job->filename,
+				job->batch.count, job->elapsed, job->ret);
+		pthread_mutex_unlock(&pool->lock);
+	}
 
-	mvprintw(6 + i, 6, _("x -\tcancel"));
+	return NULL;
 }
 
-int
-export_database()
-{
+/*
+ * import from the UI
+ *
+ * The file is parsed on a thread of its own into a batch, committed as a
+ * whole at the end, while the status line tells how far it got.
+ * Cancelling makes the rest of the file read as empty.
+ */
+
+struct import_task {
 	int filter;
-	int enum_mode = ENUM_ALL;
-	char *filename;
+	FILE *in;
+	struct db_batch batch;
+	pthread_mutex_t lock;
+	pthread_cond_t over;
+	int ret;
+	int done;
+};
 
-	export_screen();
+static int import_progress_interval = 200; /* milliseconds */
 
-	filter = getch() - 'a';
-	if(filter == 'x' - 'a' ||
-		filter >= number_of_output_filters() || filter < 0) {
-		refresh_screen();
-		return 1;
-	}
+static void *
+import_task_run(void *arg)
+{
+	struct import_task *t = arg;
+	int ret;
 
-	mvaddstr(5 + filter, 2, "->");
+	db_batch_redirect(&t->batch);
+	ret = (*i_filters[t->filter].func) (t->in);
+	db_batch_redirect(NULL);
 
-	if(selected_items()) {
-		switch(statusline_askchoice(
-			_("Export <a>ll, export <s>elected, or <c>ancel?"),
-			S_("keybindings:all/selected/cancel|asc"), 3)) {
-			case 1:
-				break;
-			case 2:
-				enum_mode = ENUM_SELECTED;
-				break;
-			case 0:
-			case 3:
-				refresh_screen();
-				return 1;
-		}
-		clear_statusline();
-	}
+	pthread_mutex_lock(&t->lock);
+	t->ret = ret;
+	t->done = TRUE;
+	pthread_cond_signal(&t->over);
+	pthread_mutex_unlock(&t->lock);
 
-	filename = ask_filename(_("Filename: "));
-	if(!filename) {
-		refresh_screen();
-		return 2;
-	}
+	return NULL;
+}
 
-	if( e_write_file(filename, e_filters[filter].func, enum_mode))
-		statusline_msg(_("Error occured while exporting"));
+/*
+ * Waits at most ms milliseconds for the end of the task, returning TRUE
+ * if it is over. n gets the number of items read so far.
+ */
+static int
+import_wait(struct import_task *t, int ms, int *n)
+{
+	struct timeval now;
+	struct timespec until;
+	int done;
+
+	gettimeofday(&now, NULL);
+	until.tv_sec = now.tv_sec + ms / 1000;
+	until.tv_nsec = (now.tv_usec + ms % 1000 * 1000) * 1000;
+	if(until.tv_nsec >= 1000000000) {
+		until.tv_sec++;
+		until.tv_nsec -= 1000000000;
+	}
 
-	refresh_screen();
-	free(filename);
+	pthread_mutex_lock(&t->lock);
+	while(!t->done &&
+			!pthread_cond_timedwait(&t->over, &t->lock, &until))
+		;
+	done = t->done;
+	*n = t->batch.count;
+	pthread_mutex_unlock(&t->lock);
 
-	return 0;
+	return done;
 }
 
-struct abook_output_item_filter select_output_item_filter(char filtname[FILTNAME_LEN]) {
-	int i;
-	for(i=0;; i++) {
-		if(!strncasecmp(u_filters[i].filtname, filtname, FILTNAME_LEN))
-		  break;
-		if(!*u_filters[i].filtname) {
-		  i = -1;
-		  break;
-		}
-	}
-	return u_filters[i];
+static void
+import_progress(struct import_task *t, int n, struct timeval *start)
+{
+	off_t pos = lseek(fileno(t->in), 0, SEEK_CUR);
+	double elapsed = elapsed_since(start);
+	char *s;
+
+	s = strdup_printf(_("Importing: %d item(s), %d/s, %lld KB read "
+				"(x to cancel)"), n,
+			(elapsed > 0) ? (int)(n / elapsed) : 0,
+			(long long)max(pos, 0) / 1024);
+	clear_statusline();
+	statusline_addstr(s);
+	free(s);
 }
 
-void
-e_write_item(FILE *out, int item, void (*func) (FILE *in, int item))
+/* the parser gets to the end of the file, returns TRUE on success */
+static int
+import_cancel(struct import_task *t)
 {
-  (*func) (out, item);
+	int fd;
+
+	if((fd = open("/dev/null", O_RDONLY)) == -1)
+		return FALSE;
+
+	dup2(fd, fileno(t->in));
+	close(fd);
+
+	return TRUE;
 }
 
+/* returns -1 if the import was cancelled, what i_read_file() does else */
 static int
-e_write_file(char *filename, int (*func) (FILE *in, struct db_enumerator e),
-		int mode)
+import_async(int filter, char *filename)
 {
-	FILE *out;
-	int ret = 0;
-	struct db_enumerator enumerator = init_db_enumerator(mode);
+	struct import_task t;
+	struct timeval start;
+	pthread_t thread;
+	int ch, n, cancelled = FALSE;
 
-	if((out = fopen(filename, "a")) == NULL)
+	if((t.in = abook_fopen(filename, "r")) == NULL)
 		return 1;
 
-	if(ftell(out)) {
-		fclose(out);
-		return 1;
+	t.filter = filter;
+	t.ret = 0;
+	t.done = FALSE;
+	db_batch_init(&t.batch);
+	pthread_mutex_init(&t.lock, NULL);
+	pthread_cond_init(&t.over, NULL);
+	t.batch.lock = &t.lock;
+
+	gettimeofday(&start, NULL);
+
+	if(pthread_create(&thread, NULL, import_task_run, &t))
+		import_task_run(&t);
+	else {
+		timeout(0);
+		while(!import_wait(&t, import_progress_interval, &n)) {
+			if(!cancelled)
+				import_progress(&t, n, &start);
+			while((ch = getch()) != ERR)
+				if(!cancelled && (ch == 'x' || ch == 7 /* ^G */))
+					cancelled = import_cancel(&t);
+		}
+		timeout(-1);
+		pthread_join(thread, NULL);
 	}
 
-	ret = (*func) (out, enumerator);
+	if(!cancelled)
+		db_batch_commit(&t.batch);
 
-	fclose(out);
+	db_batch_free(&t.batch);
+	pthread_cond_destroy(&t.over);
+	pthread_mutex_destroy(&t.lock);
+	fclose(t.in);
 
-	return ret;
+	return cancelled ? -1 : t.ret;
+}
+
+static int
+threads_count(int n_jobs)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if(n < 1)
+		n = 1;
+
+	return (int)min(n, n_jobs);
 }
 
+/*
+ * Returns -1 if the filter does not exist, otherwise the number of files
+ * which could not be imported.
+ */
 int
-fexport(char filtname[FILTNAME_LEN], FILE *handle, int enum_mode)
+import_files(char filtname[FILTNAME_LEN], abook_list *files)
 {
-	int i;
-	struct db_enumerator e = init_db_enumerator(enum_mode);
+	struct import_pool pool;
+	struct timeval start;
+	pthread_t *threads;
+	abook_list *f;
+	int i, n, n_threads, failed = 0;
 
-	for(i=0;; i++) {
-		if(!strncasecmp(e_filters[i].filtname, filtname,
-					FILTNAME_LEN))
-			break;
-		if(!*e_filters[i].filtname) {
-			i = -1;
-			break;
+	if((pool.filter = find_input_filter(filtname)) < 0)
+		return -1;
+
+	for(pool.n_jobs = 0, f = files; f; f = f->next)
+		pool.n_jobs++;
+
+	/* the libvformat parser is not known to be reentrant */
+	if(import_resizes_items(pool.filter)
+#ifdef HAVE_VFORMAT
+			|| !strcmp(i_filters[pool.filter].filtname, "vcard")
+#endif
+			) {
+		for(i = 0, f = files; f; f = f->next, i++) {
+			n = db_n_items();
+			gettimeofday(&start, NULL);
+			if(import_read(pool.filter, f->data) ||
+					n == db_n_items()) {
+				import_report(i + 1, pool.n_jobs, f->data,
+						0, 0, 1);
+				failed++;
+			} else
+				import_report(i + 1, pool.n_jobs, f->data,
+						db_n_items() - n,
+						elapsed_since(&start), 0);
 		}
+
+		return failed;
 	}
 
-	return (e_filters[i].func) (handle, e);
-}
+	pool.jobs = xmalloc0(sizeof(struct import_job) * pool.n_jobs);
+	for(i = 0, f = files; f; f = f->next, i++) {
+		pool.jobs[i].filename = f->data;
+		db_batch_init(&pool.jobs[i].batch);
+	}
+	pool.next_job = pool.done = 0;
+	pthread_mutex_init(&pool.lock, NULL);
 
+	n_threads = threads_count(pool.n_jobs);
+	threads = xmalloc(sizeof(pthread_t) * n_threads);
 
+	for(i = 0; i < n_threads; i++)
+		if(pthread_create(&threads[i], NULL, import_worker, &pool))
+			break;
 
-int
-export_file(char filtname[FILTNAME_LEN], char *filename)
-{
-	const int mode = ENUM_ALL;
-	int i;
-	int ret = 0;
-	struct db_enumerator e = init_db_enumerator(mode);
+	if(i == 0) /* no thread could be started: do the work ourselves */
+		import_worker(&pool);
 
-	for(i=0;; i++) {
-		if(!strncasecmp(e_filters[i].filtname, filtname,
-					FILTNAME_LEN))
-			break;
-		if(!*e_filters[i].filtname) {
-			i = -1;
-			break;
-		}
+	while(i-- > 0)
+		pthread_join(threads[i], NULL);
+
+	for(i = 0; i < pool.n_jobs; i++) {
+		if(pool.jobs[i].ret)
+			failed++;
+		else
+			db_batch_commit(&pool.jobs[i].batch);
+		db_batch_free(&pool.jobs[i].batch);
 	}
 
-	if(i < 0)
-		return -1;
+	pthread_mutex_destroy(&pool.lock);
+	free(threads);
+	free(pool.jobs);
 
-	if(!strcmp(filename, "-"))
-		ret = (e_filters[i].func) (stdout, e);
-	else
-		ret =  e_write_file(filename, e_filters[i].func, mode);
+	return failed;
+}
 
-	return ret;
+static int
+find_stream_filter(char filtname[FILTNAME_LEN])
+{
+	int i;
+
+	for(i=0;; i++) {
+		if(! strncasecmp(s_filters[i].filtname, filtname,
+					FILTNAME_LEN) )
+			return i;
+		if(! *s_filters[i].filtname)
+			return -1;
+	}
 }
 
 /*
- * end of common functions
+ * render cache
+ *
+ * With the export_cache option, what the item functions of s_filters[]
+ * render is kept in <source>.<format>.cache, keyed by a hash of the
+ * item and of everything else the output depends on. An export copies
+ * the items which did not change from there and renders only the others.
+ * The source is the datafile unless export_cache_source() named another.
  */
 
-/*
- * ldif import
- */
+#define RENDER_CACHE_MAGIC	"abook render cache 1\n"
 
-#include "ldif.h"
+struct render_cache_entry {
+	unsigned long long key;
+	size_t offset;	/* in render_cache.data, or .fresh_data */
+	size_t len;
+	int fresh;	/* rendered by this export */
+	int used;
+};
 
-/* During LDIF import we need more fields than the
-   ITEM_FIELDS of a *list_item. Eg: "objectclass"
-   to test valid records, ...
-   Here we extends the existing field_types enum
-   to define new fields indexes usable during processing.
-   Newly created LDIF attr names could be associated to
-   them using ldif_conv_table[]. */
-typedef enum {
-	LDIF_OBJECTCLASS = ITEM_FIELDS + 1
-} ldif_field_types;
+static char *cache_source = NULL;
+static int cache_source_set = 0;
 
-#define	LDIF_ITEM_FIELDS	LDIF_OBJECTCLASS
+/* the file the exported items are read from, NULL when there is none */
+void
+export_cache_source(char *filename)
+{
+	cache_source = filename;
+	cache_source_set = 1;
+}
 
-typedef char *ldif_item[LDIF_ITEM_FIELDS];
+struct render_cache {
+	struct abook_output_stream_filter *filter;
+	char *filename;
+	unsigned long long context;
+	char *data;	/* contents of the cache file */
+	FILE *fresh;	/* items rendered by this export */
+	char *fresh_data;
+	size_t fresh_len;
+	struct render_cache_entry *entries;
+	int n_entries, max_entries;
+	int loaded;	/* entries read from the file */
+	int used;
+	int next;	/* entry expected for the next item */
+	int *table;	/* entries indexes + 1, 0 when free */
+	int table_size;	/* a power of 2 */
+	int failed;
+};
 
-/* LDIF field's names *must* respect the ordering
-   defined by the field_types enum from database.h
-   This is only used to define (for export only)
-   abook standard field to LDIF attr name mappings */
-static ldif_item ldif_field_names = {
-	"cn",			// NAME
-	"mail",			// EMAIL
-	"streetaddress",	// ADDRESS
-	"streetaddress2",	// ADDRESS2
-	"locality",		// CITY
+static void
+render_cache_insert(struct render_cache *c, int i)
+{
+	int j, mask = c->table_size - 1;
+
+	for(j = c->entries[i].key & mask; c->table[j]; j = (j + 1) & mask)
+		;
+	c->table[j] = i + 1;
+}
+
+static void
+render_cache_index(struct render_cache *c)
+{
+	int i;
+
+	c->table_size = 2 * c->max_entries;
+	c->table = xrealloc(c->table, sizeof(int) * c->table_size);
+	memset(c->table, 0, sizeof(int) * c->table_size);
+
+	for(i = 0; i < c->n_entries; i++)
+		render_cache_insert(c, i);
+}
+
+static struct render_cache_entry *
+render_cache_find(struct render_cache *c, unsigned long long key)
+{
+	int j, mask;
+
+	/* items mostly come in the order of the previous export */
+	if(c->next < c->n_entries && c->entries[c->next].key == key)
+		return &c->entries[c->next++];
+
+	/* the index is only built once that is not the case */
+	if(!c->table)
+		render_cache_index(c);
+
+	mask = c->table_size - 1;
+	for(j = key & mask; c->table[j]; j = (j + 1) & mask)
+		if(c->entries[c->table[j] - 1].key == key) {
+			c->next = c->table[j];
+			return &c->entries[c->table[j] - 1];
+		}
+
+	return NULL;
+}
+
+static struct render_cache_entry *
+render_cache_add(struct render_cache *c, unsigned long long key,
+		size_t offset, size_t len, int fresh)
+{
+	struct render_cache_entry *e;
+
+	if(c->n_entries == c->max_entries) {
+		c->max_entries *= 2;
+		c->entries = xrealloc(c->entries,
+			sizeof(struct render_cache_entry) * c->max_entries);
+		if(c->table)
+			render_cache_index(c);
+	}
+
+	e = &c->entries[c->n_entries++];
+	e->key = key;
+	e->offset = offset;
+	e->len = len;
+	e->fresh = fresh;
+	e->used = 0;
+
+	if(c->table)
+		render_cache_insert(c, c->n_entries - 1);
+
+	return e;
+}
+
+static void
+render_cache_load(struct render_cache *c)
+{
+	FILE *in;
+	struct stat st;
+	unsigned long long key, len;
+	size_t head = sizeof(RENDER_CACHE_MAGIC) - 1 + sizeof(c->context);
+	char *p, *end;
+
+	if((in = abook_fopen(c->filename, "r")) == NULL)
+		return;
+
+	if(fstat(fileno(in), &st) || (size_t)st.st_size < head)
+		goto out;
+
+	c->data = xmalloc(st.st_size);
+	if(fread(c->data, 1, st.st_size, in) != (size_t)st.st_size ||
+			memcmp(c->data, RENDER_CACHE_MAGIC, head -
+				sizeof(c->context)) ||
+			memcmp(c->data + head - sizeof(c->context),
+				&c->context, sizeof(c->context))) {
+		/* another version, or other options: start over */
+		xfree(c->data);
+		goto out;
+	}
+
+	for(p = c->data + head, end = c->data + st.st_size;
+			(size_t)(end - p) >= sizeof(key) + sizeof(len);
+			p += len) {
+		memcpy(&key, p, sizeof(key));
+		memcpy(&len, p + sizeof(key), sizeof(len));
+		p += sizeof(key) + sizeof(len);
+		if(len > (unsigned long long)(end - p))
+			break;
+		render_cache_add(c, key, p - c->data, len, 0);
+	}
+	c->loaded = c->n_entries;
+
+out:
+	fclose(in);
+}
+
+/* returns -1 if the output of this filter is not cached */
+static int
+render_cache_open(struct render_cache *c,
+		struct abook_output_stream_filter *filter)
+{
+#ifdef HAVE_OPEN_MEMSTREAM
+	abook_field_list *cur;
+	unsigned long long h = HASH_INIT;
+	char *source = cache_source_set ? cache_source : datafile;
+	struct stat st;
+	int *ids, n;
+
+	/* write_database_item() numbers the items */
+	if(!opt_get_bool(BOOL_EXPORT_CACHE) || !source ||
+			stat(source, &st) || !S_ISREG(st.st_mode) ||
+			!strcmp(filter->filtname, "abook"))
+		return -1;
+
+	memset(c, 0, sizeof(struct render_cache));
+	if((c->fresh = open_memstream(&c->fresh_data, &c->fresh_len)) == NULL)
+		return -1;
+
+	h = hash_str(h, filter->filtname);
+	if(!strcmp(filter->filtname, "custom"))
+		h = hash_str(h, custom_format);
+	for(cur = fields_list; cur; cur = cur->next)
+		h = hash_str(h, cur->field->key);
+	if((n = db_get_projection(&ids)) >= 0)
+		h = hash_add(h, ids, sizeof(int) * n);
+	h = hash_str(h, safe_str(setlocale(LC_ALL, NULL)));
+
+	c->filter = filter;
+	c->context = opt_hash(h);
+	c->filename = strconcat(source, ".", filter->filtname, ".cache",
+			NULL);
+	c->max_entries = 64;
+	c->entries = xmalloc(sizeof(struct render_cache_entry) *
+			c->max_entries);
+
+	render_cache_load(c);
+
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+static void
+render_cache_item(struct render_cache *c, FILE *out, int item, int n)
+{
+	unsigned long long key = db_item_hash(item, c->context);
+	struct render_cache_entry *e;
+	size_t start = c->fresh_len;
+
+	if(c->failed) {
+		(*c->filter->item) (out, item, n);
+		return;
+	}
+
+	if((e = render_cache_find(c, key)) == NULL) {
+		(*c->filter->item) (c->fresh, item, n);
+		if(fflush(c->fresh)) {
+			c->failed = 1;
+			(*c->filter->item) (out, item, n);
+			return;
+		}
+		e = render_cache_add(c, key, start, c->fresh_len - start, 1);
+	}
+
+	if(!e->used) {
+		e->used = 1;
+		c->used++;
+	}
+
+	fwrite((e->fresh ? c->fresh_data : c->data) + e->offset, 1, e->len,
+			out);
+}
+
+/* writes the entries used by this export back, if anything changed */
+static void
+render_cache_save(struct render_cache *c)
+{
+	struct render_cache_entry *e;
+	struct outbuf b;
+	unsigned long long len;
+	char *tmp;
+	FILE *f;
+	int i, fd, ret;
+
+	if(c->used == c->loaded && c->n_entries == c->loaded)
+		return;
+
+	/* exports running at the same time each write their own file */
+	tmp = strconcat(c->filename, ".XXXXXX", NULL);
+	if((fd = mkstemp(tmp)) == -1)
+		goto out;
+	if((f = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		unlink(tmp);
+		goto out;
+	}
+
+	outbuf_init(&b, f, NULL, OUTBUF_BLOCK);
+	outbuf_literal(&b, RENDER_CACHE_MAGIC);
+	outbuf_add(&b, (char *)&c->context, sizeof(c->context));
+	for(i = 0; i < c->n_entries; i++) {
+		e = &c->entries[i];
+		if(!e->used)
+			continue;
+		len = e->len;
+		outbuf_add(&b, (char *)&e->key, sizeof(e->key));
+		outbuf_add(&b, (char *)&len, sizeof(len));
+		outbuf_add(&b, (e->fresh ? c->fresh_data : c->data) +
+				e->offset, e->len);
+	}
+
+	ret = outbuf_flush(&b);
+	if(!ret)
+		ret = fflush(f) || fsync(fd);
+	if(fclose(f) || ret || rename(tmp, c->filename))
+		unlink(tmp);
+	outbuf_free(&b);
+
+out:
+	free(tmp);
+}
+
+static void
+render_cache_close(struct render_cache *c, int save)
+{
+	if(save && !c->failed)
+		render_cache_save(c);
+
+	fclose(c->fresh);
+	free(c->fresh_data);
+	free(c->data);
+	free(c->entries);
+	free(c->table);
+	free(c->filename);
+}
+
+/*
+ * Returns -1 if the export does not go through the render cache,
+ * otherwise 0, or 1 on write error.
+ */
+static int
+export_cached(char filtname[FILTNAME_LEN], FILE *out, struct db_enumerator e)
+{
+	struct render_cache c;
+	int i, n = 0;
+
+	if(list_is_empty() || (i = find_stream_filter(filtname)) < 0 ||
+			render_cache_open(&c, &s_filters[i]))
+		return -1;
+
+	if(c.filter->head)
+		(*c.filter->head) (out);
+
+	db_enumerate_items(e)
+		render_cache_item(&c, out, e.item, n++);
+
+	if(c.filter->tail)
+		(*c.filter->tail) (out);
+
+	render_cache_close(&c, 1);
+
+	return ferror(out) ? 1 : 0;
+}
+
+/*
+ * streaming conversion
+ *
+ * Items are written out as soon as the input filter produces them, so
+ * the database never holds more than one of them.
+ */
+
+struct convert_stream {
+	struct abook_output_stream_filter *filter;
+	char *filename;
+	FILE *out;
+	int seen;	/* items read, n counts the ones written */
+	int n;
+	int failed;
+	int cached;
+	struct render_cache cache;
+};
+
+/* the output is only created once there is something to write */
+static int
+convert_stream_open(struct convert_stream *s)
+{
+	if(s->out)
+		return 0;
+
+	if(!strcmp(s->filename, "-"))
+		s->out = stdout;
+	else if((s->out = fopen(s->filename, "a")) == NULL ||
+			ftell(s->out)) {
+		s->failed = 1;
+		return -1;
+	}
+
+	if(s->filter->head)
+		(*s->filter->head) (s->out);
+
+	return 0;
+}
+
+static void
+convert_stream_item(int item, void *data)
+{
+	struct convert_stream *s = data;
+
+	s->seen++;
+	if(s->failed || !db_item_matches(item) || convert_stream_open(s))
+		return;
+
+	if(s->cached)
+		render_cache_item(&s->cache, s->out, item, s->n++);
+	else
+		(*s->filter->item) (s->out, item, s->n++);
+}
+
+/*
+ * Returns -1 when the conversion can't be streamed, 1 when the input
+ * can't be read and 2 when the output can't be written.
+ */
+int
+convert_stream(char srcformat[FILTNAME_LEN], char *srcfile,
+		char dstformat[FILTNAME_LEN], char *dstfile)
+{
+	struct convert_stream s;
+	int i, j, ret;
+
+	if((i = find_input_filter(srcformat)) < 0 ||
+			(j = find_stream_filter(dstformat)) < 0)
+		return -1;
+
+	/* new fields may be declared while parsing */
+	if((!strcmp(i_filters[i].filtname, "abook") ||
+			!strcmp(i_filters[i].filtname, "auto")) &&
+			!strcasecmp(opt_get_str(STR_PRESERVE_FIELDS), "all"))
+		return -1;
+
+	s.filter = &s_filters[j];
+	s.filename = dstfile;
+	s.out = NULL;
+	s.seen = s.n = s.failed = 0;
+	s.cached = !render_cache_open(&s.cache, s.filter);
+
+	db_stream_redirect(convert_stream_item, &s);
+	ret = import_read(i, srcfile);
+	db_stream_redirect(NULL, NULL);
+
+	if(s.cached)
+		render_cache_close(&s.cache, !ret && !s.failed);
+
+	/* no item matched the conditions */
+	if(!ret && s.seen && !s.out)
+		convert_stream_open(&s);
+
+	if(s.out) {
+		if(!s.failed && s.filter->tail)
+			(*s.filter->tail) (s.out);
+		if(s.out != stdout)
+			fclose(s.out);
+	}
+
+	if(s.failed)
+		return 2;
+
+	return (ret || !s.seen) ? 1 : 0;
+}
+
+/*
+ * parallel export
+ *
+ * The items are cut in chunks, which a pool of threads renders with the
+ * item function of s_filters[], each chunk into its own memory stream.
+ * The chunks are written out in order, so the output is the same as the
+ * one of the sequential exporter.
+ */
+
+#define EXPORT_PARALLEL_MIN_ITEMS	4096
+#define EXPORT_CHUNK_ITEMS		512
+#define EXPORT_CHUNKS_AHEAD		4 /* per thread */
+
+struct export_chunk {
+	int first;	/* index in export_pool.items */
+	int count;
+	char *data;
+	size_t len;
+	int ready;
+	int failed;
+};
+
+struct export_pool {
+	struct abook_output_stream_filter *filter;
+	int *items;
+	struct export_chunk *chunks;
+	int n_chunks;
+	int next_chunk;
+	int written;	/* chunks written out so far */
+	int ahead;	/* chunks which may wait to be written out */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+#ifdef HAVE_OPEN_MEMSTREAM
+static void *
+export_worker(void *arg)
+{
+	struct export_pool *pool = arg;
+	struct export_chunk *chunk;
+	FILE *f;
+	int i;
+
+	for(;;) {
+		pthread_mutex_lock(&pool->lock);
+		/* do not get too far ahead of the output */
+		while(pool->next_chunk < pool->n_chunks &&
+				pool->next_chunk >= pool->written + pool->ahead)
+			pthread_cond_wait(&pool->cond, &pool->lock);
+		chunk = (pool->next_chunk < pool->n_chunks) ?
+			&pool->chunks[pool->next_chunk++] : NULL;
+		pthread_mutex_unlock(&pool->lock);
+
+		if(!chunk)
+			break;
+
+		if((f = open_memstream(&chunk->data, &chunk->len))) {
+			for(i = chunk->first; i < chunk->first + chunk->count;
+					i++)
+				(*pool->filter->item) (f, pool->items[i], i);
+			if(fclose(f))
+				chunk->failed = 1;
+		} else
+			chunk->failed = 1;
+
+		pthread_mutex_lock(&pool->lock);
+		chunk->ready = 1;
+		pthread_cond_broadcast(&pool->cond);
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	return NULL;
+}
+#endif
+
+/*
+ * Returns -1 if the export is not done in parallel (not worth it or not
+ * possible), otherwise 0, or 1 on write error.
+ */
+static int
+export_parallel(char filtname[FILTNAME_LEN], FILE *out,
+		struct db_enumerator e)
+{
+#ifdef HAVE_OPEN_MEMSTREAM
+	struct export_pool pool;
+	struct export_chunk *chunk;
+	struct db_enumerator count = e;
+	pthread_t *threads;
+	int i, j, k, ret, n_items = 0, n_threads;
+
+	db_enumerate_items(count)
+		n_items++;
+
+	if(n_items < EXPORT_PARALLEL_MIN_ITEMS ||
+			(i = find_stream_filter(filtname)) < 0 ||
+			(n_threads = threads_count(n_items /
+				EXPORT_CHUNK_ITEMS)) < 2)
+		return -1;
+
+	pool.filter = &s_filters[i];
+	pool.items = xmalloc(sizeof(int) * n_items);
+	i = 0;
+	db_enumerate_items(e)
+		pool.items[i++] = e.item;
+
+	pool.n_chunks = (n_items + EXPORT_CHUNK_ITEMS - 1) / EXPORT_CHUNK_ITEMS;
+	pool.chunks = xmalloc0(sizeof(struct export_chunk) * pool.n_chunks);
+	for(i = 0; i < pool.n_chunks; i++) {
+		pool.chunks[i].first = i * EXPORT_CHUNK_ITEMS;
+		pool.chunks[i].count = min(EXPORT_CHUNK_ITEMS,
+				n_items - pool.chunks[i].first);
+	}
+	pool.next_chunk = pool.written = 0;
+	pool.ahead = n_threads * EXPORT_CHUNKS_AHEAD;
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.cond, NULL);
+
+	/* the head may set up what the item function needs */
+	if(pool.filter->head)
+		(*pool.filter->head) (out);
+
+	threads = xmalloc(sizeof(pthread_t) * n_threads);
+	for(i = 0; i < n_threads; i++)
+		if(pthread_create(&threads[i], NULL, export_worker, &pool))
+			break;
+
+	if(i == 0) /* no thread could be started: write everything directly */
+		for(j = 0; j < pool.n_chunks; j++)
+			pool.chunks[j].ready = pool.chunks[j].failed = 1;
+
+	for(j = 0; j < pool.n_chunks; j++) {
+		chunk = &pool.chunks[j];
+
+		pthread_mutex_lock(&pool.lock);
+		while(!chunk->ready)
+			pthread_cond_wait(&pool.cond, &pool.lock);
+		pthread_mutex_unlock(&pool.lock);
+
+		if(chunk->failed) {
+			for(k = chunk->first;
+					k < chunk->first + chunk->count; k++)
+				(*pool.filter->item) (out, pool.items[k], k);
+		} else
+			fwrite(chunk->data, 1, chunk->len, out);
+		xfree(chunk->data);
+
+		pthread_mutex_lock(&pool.lock);
+		pool.written++;
+		pthread_cond_broadcast(&pool.cond);
+		pthread_mutex_unlock(&pool.lock);
+	}
+
+	if(pool.filter->tail)
+		(*pool.filter->tail) (out);
+
+	ret = ferror(out) ? 1 : 0;
+
+	while(i-- > 0)
+		pthread_join(threads[i], NULL);
+
+	pthread_cond_destroy(&pool.cond);
+	pthread_mutex_destroy(&pool.lock);
+	free(threads);
+	free(pool.chunks);
+	free(pool.items);
+
+	return ret;
+#else
+	return -1;
+#endif
+}
+
+/*
+ * export
+ */
+
+static int e_write_file(char *filename, int filter, int mode);
+
+static void
+export_screen()
+{
+	int i;
+
+	clear();
+
+
+	refresh_statusline();
+	headerline(_("export database"));
+
+	mvaddstr(3, 1, _("please select a filter"));
+
+
+	for(i = 0; *e_filters[i].filtname ; i++)
+		mvprintw(5 + i, 6, "%c -\t%s\t%s\n", 'a' + i,
+			e_filters[i].filtname,
+			gettext(e_filters[i].desc));
+
+	mvprintw(6 + i, 6, _("x -\tcancel"));
+}
+
+int
+export_database()
+{
+	int filter;
+	int enum_mode = ENUM_SHOWN;
+	char *filename;
+
+	export_screen();
+
+	filter = getch() - 'a';
+	if(filter == 'x' - 'a' ||
+		filter >= number_of_output_filters() || filter < 0) {
+		refresh_screen();
+		return 1;
+	}
+
+	mvaddstr(5 + filter, 2, "->");
+
+	if(selected_items()) {
+		switch(statusline_askchoice(
+			_("Export <a>ll, export <s>elected, or <c>ancel?"),
+			S_("keybindings:all/selected/cancel|asc"), 3)) {
+			case 1:
+				break;
+			case 2:
+				enum_mode = ENUM_SELECTED;
+				break;
+			case 0:
+			case 3:
+				refresh_screen();
+				return 1;
+		}
+		clear_statusline();
+	}
+
+	filename = ask_filename(_("Filename: "));
+	if(!filename) {
+		refresh_screen();
+		return 2;
+	}
+
+	if( e_write_file(filename, filter, enum_mode))
+		statusline_msg(_("Error occured while exporting"));
+
+	refresh_screen();
+	free(filename);
+
+	return 0;
+}
+
+struct abook_output_item_filter select_output_item_filter(char filtname[FILTNAME_LEN]) {
+	int i;
+	for(i=0;; i++) {
+		if(!strncasecmp(u_filters[i].filtname, filtname, FILTNAME_LEN))
+		  break;
+		if(!*u_filters[i].filtname) {
+		  i = -1;
+		  break;
+		}
+	}
+	return u_filters[i];
+}
+
+void
+e_write_item(FILE *out, int item, void (*func) (FILE *in, int item))
+{
+  (*func) (out, item);
+}
+
+/*
+ * writes with e_filters[filter], through the render cache if enabled or
+ * in parallel when it is worth it
+ */
+static int
+export_filter(int filter, FILE *out, struct db_enumerator e)
+{
+	int ret;
+
+	if((ret = export_cached(e_filters[filter].filtname, out, e)) != -1 ||
+			(ret = export_parallel(e_filters[filter].filtname,
+				out, e)) != -1)
+		return ret;
+
+	return (*e_filters[filter].func) (out, e);
+}
+
+static int
+e_write_file(char *filename, int filter, int mode)
+{
+	FILE *out;
+	int ret = 0;
+	struct db_enumerator enumerator = init_db_enumerator(mode);
+
+	if((out = fopen(filename, "a")) == NULL)
+		return 1;
+
+	if(ftell(out)) {
+		fclose(out);
+		return 1;
+	}
+
+	ret = export_filter(filter, out, enumerator);
+
+	fclose(out);
+
+	return ret;
+}
+
+int
+fexport(char filtname[FILTNAME_LEN], FILE *handle, int enum_mode)
+{
+	int i;
+	struct db_enumerator e = init_db_enumerator(enum_mode);
+
+	for(i=0;; i++) {
+		if(!strncasecmp(e_filters[i].filtname, filtname,
+					FILTNAME_LEN))
+			break;
+		if(!*e_filters[i].filtname) {
+			i = -1;
+			break;
+		}
+	}
+
+	return export_filter(i, handle, e);
+}
+
+
+
+int
+export_file(char filtname[FILTNAME_LEN], char *filename, int mode)
+{
+	int i;
+	int ret = 0;
+	struct db_enumerator e = init_db_enumerator(mode);
+
+	for(i=0;; i++) {
+		if(!strncasecmp(e_filters[i].filtname, filtname,
+					FILTNAME_LEN))
+			break;
+		if(!*e_filters[i].filtname) {
+			i = -1;
+			break;
+		}
+	}
+
+	if(i < 0)
+		return -1;
+
+	if(!strcmp(filename, "-"))
+		ret = export_filter(i, stdout, e);
+	else
+		ret =  e_write_file(filename, i, mode);
+
+	return ret;
+}
+
+/*
+ * end of common functions
+ */
+
+/*
+ * ldif import
+ */
+
+#include "ldif.h"
+
+/* During LDIF import we need more fields than the
+   ITEM_FIELDS of a *list_item. Eg: "objectclass"
+   to test valid records, ...
+   Here we extends the existing field_types enum
+   to define new fields indexes usable during processing.
+   Newly created LDIF attr names could be associated to
+   them using ldif_conv_table[]. */
+typedef enum {
+	LDIF_OBJECTCLASS = ITEM_FIELDS + 1
+} ldif_field_types;
+
+#define	LDIF_ITEM_FIELDS	(LDIF_OBJECTCLASS + 1)
+
+typedef char *ldif_item[LDIF_ITEM_FIELDS];
+
+/* LDIF field's names *must* respect the ordering
+   defined by the field_types enum from database.h
+   This is only used to define (for export only)
+   abook standard field to LDIF attr name mappings */
+static ldif_item ldif_field_names = {
+	"cn",			// NAME
+	"mail",			// EMAIL
+	"streetaddress",	// ADDRESS
+	"streetaddress2",	// ADDRESS2
+	"locality",		// CITY
 	"st",			// STATE
 	"postalcode",		// ZIP
 	"countryname",		// COUNTRY
@@ -617,35 +1679,29 @@ const int LDIF_IMPORTABLE_ITEM_FIELDS = (int)sizeof(ldif_conv_table)/sizeof(*ldi
 /*
   Handles multi-line strings.
   If a string starts with a space, it's the continuation
-  of the previous line. Thus we need to always read ahead.
-  But for this to work with stdin, we need to stores the next
-  line for later use in case it's not a continuation of the
-  first line.
+  of the previous line. Thus we need to always read ahead,
+  and give the next line back to the reader in case it's not
+  a continuation of the first line.
  */
 static char *
-ldif_read_line(FILE *in, char **next_line)
+ldif_read_line(struct line_reader *r)
 {
 	char *buf = NULL;
 	char *ptr, *tmp;
 	char *line;
 
 	// buf filled with the first line
-	if(!*next_line)
-		buf = getaline(in);
-	else {
-		buf = xstrdup(*next_line);
-		xfree(*next_line);
-	}
+	if((line = line_reader_read(r)) != NULL)
+		buf = xstrdup(line);
 
-	while(!feof(in)) {
-		// if no line already read-ahead.
-		line = getaline(in);
+	while(!line_reader_eof(r)) {
+		line = line_reader_read(r);
 		if(!line) break;
 
 		// this is not a continuation of what is already in buf
-		// store it for the next round
+		// leave it for the next round
 		if(*line != ' ') {
-			*next_line = line;
+			line_reader_unread(r);
 			break;
 		}
 
@@ -657,7 +1713,6 @@ ldif_read_line(FILE *in, char **next_line)
 		tmp = buf;
 		buf = strconcat(buf, ptr, NULL);
 		free(tmp);
-		free(line);
 	}
 
 	if(buf && *buf == '#' ) {
@@ -688,8 +1743,7 @@ ldif_add_item(ldif_item li)
 			item[i] = xstrdup(li[i]);
 	}
 
-	add_item2database(item);
-	item_free(&item);
+	db_adopt_item(item);
 
 bail_out:
 	for(i=0; i < LDIF_ITEM_FIELDS; i++)
@@ -765,8 +1819,8 @@ ldif_convert(ldif_item item, char *type, char *value)
 static int
 ldif_parse_file(FILE *handle)
 {
+	struct line_reader r;
 	char *line = NULL;
-	char *next_line = NULL;
 	char *type, *value;
 	int vlen;
 
@@ -777,9 +1831,10 @@ ldif_parse_file(FILE *handle)
 	ldif_item item;
 
 	memset(item, 0, sizeof(item));
+	line_reader_init(&r, handle);
 
 	do {
-		line = ldif_read_line(handle, &next_line);
+		line = ldif_read_line(&r);
 
 		// EOF or empty lines: continue;
 		if(!line || *line == '\0') continue;
@@ -792,7 +1847,9 @@ ldif_parse_file(FILE *handle)
 		ldif_convert(item, type, value);
 
 		xfree(line);
-	} while ( !feof(handle) );
+	} while ( !line_reader_eof(&r) );
+
+	line_reader_free(&r);
 
 	// force registration (= ldif_add_item()) of the last LDIF entry
 	ldif_convert(item, "dn", "");
@@ -811,21 +1868,19 @@ ldif_parse_file(FILE *handle)
 #include "getname.h"
 
 static int
-mutt_read_line(FILE *in, char **groups, char **alias, char **rest)
+mutt_read_line(struct line_reader *r, char **groups, char **alias, char **rest)
 {
 	char *line, *ptr;
 	char *start, *end;
 	abook_list *glist = NULL;
 
-	if( !(line = ptr = getaline(in)) )
+	if( !(line = ptr = line_reader_read(r)) )
 		return 1; /* error / EOF */
 
 	SKIPWS(ptr);
 
-	if(strncmp("alias", ptr, 5)) {
-		free(line);
+	if(strncmp("alias", ptr, 5))
 		return 1;
-	}
 
 	ptr += 5;
 	SKIPWS(ptr);
@@ -860,7 +1915,6 @@ mutt_read_line(FILE *in, char **groups, char **alias, char **rest)
 	/* rest (email) */
 	*rest = xstrdup(ptr);
 
-	xfree(line);
 	return 0;
 }
 
@@ -930,25 +1984,29 @@ mutt_parse_email(list_item item)
 static int
 mutt_parse_file(FILE *in)
 {
-	list_item item = item_create();
+	struct line_reader r;
+	list_item item;
+
+	line_reader_init(&r, in);
 
 	for(;;) {
-		memset(item, 0, fields_count * sizeof(char *));
+		item = item_create();
 
-		if(!mutt_read_line(in,
+		if(!mutt_read_line(&r,
 			(field_id(GROUPS) != -1) ? &item[field_id(GROUPS)] : NULL,
 			(field_id(NICK) != -1) ? &item[field_id(NICK)] : NULL,
 			&item[field_id(NAME)]) )
 			mutt_parse_email(item);
 
-		if(feof(in)) {
+		if(line_reader_eof(&r)) {
 			item_empty(item);
+			item_free(&item);
 			break;
 		}
 
-		add_item2database(item);
+		db_adopt_item(item);
 	}
-	item_free(&item);
+	line_reader_free(&r);
 
 	return 0;
 }
@@ -962,65 +2020,103 @@ mutt_parse_file(FILE *in)
  * ldif export filter
  */
 
+/*
+ * The attributes written for each item, in order, see ldif_export_head()
+ */
+struct ldif_attribute {
+	int id;		/* field id, -1 for the e-mail addresses */
+	char *type;
+	int len;
+};
+
+static struct ldif_attribute ldif_attributes[ITEM_FIELDS];
+static int ldif_attributes_count;
+
 static void
-ldif_fput_type_and_value(FILE *out,char *type, char *value )
+ldif_export_head(FILE *out)
 {
-	char *tmp;
+	struct ldif_attribute *a = ldif_attributes;
+	int j;
 
-	tmp = ldif_type_and_value(type, value, strlen(value));
+	for(j = 0; j < ITEM_FIELDS; j++) {
+		if(j == EMAIL)
+			a->id = -1;
+		else if((a->id = field_id(j)) == -1)
+			continue;
+		a->type = ldif_field_names[j];
+		a->len = strlen(a->type);
+		a++;
+	}
+	ldif_attributes_count = a - ldif_attributes;
 
-	fputs(tmp, out);
+	fprintf(out, "version: 1\n");
+}
 
-	free(tmp);
+static void
+ldif_put_item(struct outbuf *b, int item)
+{
+	struct db_email_iter it = init_db_email_iter(item);
+	struct ldif_attribute *a, *end;
+	struct outbuf dn;
+	char space[256], *name = safe_str(db_name_get(item));
+	char *val;
+
+	/* TODO: this may not be enough for a trully "Distinguished" name
+	   needed by LDAP. Appending a random uuid could do the trick */
+	outbuf_init(&dn, NULL, space, sizeof(space));
+	outbuf_literal(&dn, "cn=");
+	outbuf_puts(&dn, name);
+	if(db_email_iter_next(&it)) {
+		outbuf_literal(&dn, ",mail=");
+		outbuf_add(&dn, it.email, it.len);
+	}
+	ldif_put_type_and_value(b, "dn", 2, dn.data, dn.len);
+	outbuf_free(&dn);
+
+	end = ldif_attributes + ldif_attributes_count;
+	for(a = ldif_attributes; a < end; a++) {
+		if(a->id == -1) {
+			it = init_db_email_iter(item);
+			db_enumerate_emails(it)
+				ldif_put_type_and_value(b, a->type, a->len,
+						it.email, it.len);
+		} else if((val = db_fget_byid(item, a->id)))
+			ldif_put_type_and_value(b, a->type, a->len,
+					val, strlen(val));
+	}
+
+	outbuf_literal(b, "objectclass: top\n"
+			"objectclass: person\n\n");
 }
 
-static int
-ldif_export_database(FILE *out, struct db_enumerator e)
+static void
+ldif_export_item(FILE *out, int item, int n)
 {
-	char email[MAX_EMAILSTR_LEN];
-	abook_list *emails, *em;
+	struct outbuf b;
+	char space[BUFSIZ];
 
-	fprintf(out, "version: 1\n");
+	outbuf_init(&b, out, space, sizeof(space));
+	ldif_put_item(&b, item);
+	outbuf_flush(&b);
+}
 
-	db_enumerate_items(e) {
-		char *tmp;
-		int j;
-		get_first_email(email, e.item);
+static int
+ldif_export_database(FILE *out, struct db_enumerator e)
+{
+	struct outbuf b;
+	int ret;
 
-		if(*email)
-			tmp = strdup_printf("cn=%s,mail=%s",db_name_get(e.item),email);
-		/* TODO: this may not be enough for a trully "Distinguished" name
-		   needed by LDAP. Appending a random uuid could do the trick */
-		else
-			tmp = strdup_printf("cn=%s",db_name_get(e.item));
+	ldif_export_head(out);
 
-		ldif_fput_type_and_value(out, "dn", tmp);
-		free(tmp);
+	outbuf_init(&b, out, NULL, OUTBUF_BLOCK);
 
-		for(j = 0; j < ITEM_FIELDS; j++) {
-			if(j == EMAIL) {
-				if(*email) {
-					tmp = db_email_get(e.item);
-					emails = csv_to_abook_list(tmp);
-					free(tmp);
-					for(em = emails; em; em = em->next)
-						ldif_fput_type_and_value(out,
-						                         ldif_field_names[EMAIL],
-						                         em->data);
-				}
-			}
-			else if(db_fget(e.item,j)) {
-				ldif_fput_type_and_value(out,
-				                         ldif_field_names[j],
-				                         db_fget(e.item, j));
-			}
-		}
+	db_enumerate_items(e)
+		ldif_put_item(&b, e.item);
 
-		fprintf(out, "objectclass: top\n"
-				"objectclass: person\n\n");
-	}
+	ret = outbuf_flush(&b);
+	outbuf_free(&b);
 
-	return 0;
+	return ret;
 }
 
 /*
@@ -1029,125 +2125,225 @@ ldif_export_database(FILE *out, struct db_enumerator e)
 
 /*
  * html export filter
+ *
+ * The columns come from index_format, compiled once per export into a
+ * plan of their own rather than going through the index of the list view.
  */
 
-static void            html_export_write_head(FILE *out);
-static void            html_export_write_tail(FILE *out);
+struct html_field {
+	int id;
+	int type;
+};
 
-extern struct index_elem *index_elements;
+/* a column shows the first non-empty one of its fields */
+struct html_column {
+	int first;	/* in html_fields */
+	int count;
+};
 
-static void
-html_print_emails(FILE *out, struct list_field *f)
-{
-	abook_list *l = csv_to_abook_list(f->data);
+static struct html_field *html_fields = NULL;
+static int html_fields_count = 0;
+static struct html_column *html_columns = NULL;
+static int html_columns_count = 0;
 
-	for(; l; l = l->next) {
-		fprintf(out, "<a href=\"mailto:%s\">%s</a>", l->data, l->data);
-		if(l->next)
-			fprintf(out, ", ");
+static const char *
+html_escape(int c)
+{
+	switch(c) {
+		case '&': return "&amp;";
+		case '<': return "&lt;";
+		case '>': return "&gt;";
+		case '"': return "&quot;";
 	}
 
-	abook_list_free(&l);
+	return NULL;
 }
 
-static int
-html_export_database(FILE *out, struct db_enumerator e)
+static void
+html_add_field(int column, const char *key, size_t len)
 {
-	struct list_field f;
-	struct index_elem *cur;
-
-	if(list_is_empty())
-		return 2;
+	char *name = xstrndup(key, len);
+	int id;
 
-	init_index();
-
-	html_export_write_head(out);
-
-	db_enumerate_items(e) {
-		fprintf(out, " <tr>\n");
-		for(cur = index_elements; cur; cur = cur->next) {
-			if(cur->type != INDEX_FIELD)
-				continue;
+	find_field_number(name, &id);
+	free(name);
+	if(id == -1)
+		return;
 
-			get_list_field(e.item, cur, &f);
+	if(column == html_columns_count) {
+		html_columns = xrealloc(html_columns,
+			sizeof(struct html_column) * ++html_columns_count);
+		html_columns[column].first = html_fields_count;
+		html_columns[column].count = 0;
+	}
 
-			fprintf(out, "  <td>");
+	html_fields = xrealloc(html_fields,
+			sizeof(struct html_field) * ++html_fields_count);
+	html_fields[html_fields_count - 1].id = id;
+	get_field_info(id, NULL, NULL, &html_fields[html_fields_count - 1].type);
+	html_columns[column].count++;
+}
 
-			if(f.type == FIELD_EMAILS) {
-				html_print_emails(out, &f);
-			} else {
-				if (strcmp(safe_str(f.data), "") == 0)
-					fprintf(out, "&nbsp;");
-				else
-					fprintf(out, "%s", safe_str(f.data));
-			}
-			fprintf(out, "</td>\n");
+/* {field:len|alternate|...} placeholders of index_format, the rest is ignored */
+static void
+html_compile_columns(const char *s)
+{
+	const char *end, *p, *q, *colon;
+	int column;
+
+	html_fields_count = html_columns_count = 0;
+
+	while((s = strchr(s, '{')) && (end = strchr(++s, '}'))) {
+		column = html_columns_count;
+		for(p = s; p < end; p = q + 1) {
+			if((q = memchr(p, '|', end - p)) == NULL)
+				q = end;
+			if((colon = memchr(p, ':', q - p)) == NULL)
+				colon = q;
+			html_add_field(column, p, colon - p);
 		}
-		fprintf(out, " </tr>\n");
+		s = end + 1;
 	}
+}
 
-	html_export_write_tail(out);
-
-	return 0;
+static void
+html_put_emails(struct outbuf *b, char *s)
+{
+	struct db_email_iter em = init_email_iter(s);
+	int n = 0;
+
+	db_enumerate_emails(em) {
+		if(n++)
+			outbuf_literal(b, ", ");
+		outbuf_literal(b, "<a href=\"mailto:");
+		outbuf_escaped(b, em.email, em.len, html_escape);
+		outbuf_literal(b, "\">");
+		outbuf_escaped(b, em.email, em.len, html_escape);
+		outbuf_literal(b, "</a>");
+	}
 }
 
 static void
-html_export_write_head(FILE *out)
-{
-	char *realname = get_real_name(), *str;
-	struct index_elem *cur;
-
-	fprintf(out, "<!DOCTYPE html>\n");
-	fprintf(out, "<html>\n");
-	fprintf(out, "<head>\n");
-	fprintf(out, " <meta charset=\"utf-8\" />\n");
-	fprintf(out, " <title>");
-	fprintf(out, _("%s's addressbook"), realname );
-	fprintf(out, "</title>\n");
-	fprintf(out, " <style type=\"text/css\">\n");
-	fprintf(out, "  table {border-collapse: collapse ; border: 1px solid #000;}\n");
-	fprintf(out, "  table th, table td {text-align: left; border: 1px solid #000; padding: 0.33em;}\n");
-	fprintf(out, "  table th {border-bottom: 3px double #000; background-color: #ccc;}\n");
-	fprintf(out, " </style>\n");
-	fprintf(out, "</head>\n");
-	fprintf(out, "<body>\n");
-	fprintf(out, "<h1>");
-	fprintf(out, _("%s's addressbook"), realname);
-	fprintf(out, "</h1>\n");
-
-	fprintf(out, "<table>\n");
-	fprintf(out, "<thead>\n");
-	fprintf(out, " <tr>\n");
-	for(cur = index_elements; cur; cur = cur->next) {
-		if(cur->type != INDEX_FIELD)
-			continue;
+html_put_item(struct outbuf *b, int item)
+{
+	struct html_field *f = NULL;
+	char *data;
+	int i, j;
+
+	outbuf_literal(b, " <tr>\n");
+	for(i = 0; i < html_columns_count; i++) {
+		data = NULL;
+		for(j = 0; j < html_columns[i].count; j++) {
+			f = &html_fields[html_columns[i].first + j];
+			if((data = db_fget_byid(item, f->id)) && *data)
+				break;
+		}
 
-		get_field_info(cur->d.field.id, NULL, &str, NULL);
+		outbuf_literal(b, "  <td>");
+		if(!data || !*data)
+			outbuf_literal(b, "&nbsp;");
+		else if(f->type == FIELD_EMAILS)
+			html_put_emails(b, data);
+		else
+			outbuf_escaped(b, data, strlen(data), html_escape);
+		outbuf_literal(b, "</td>\n");
+	}
+	outbuf_literal(b, " </tr>\n");
+}
 
-		fprintf(out, "  <th>");
+static void
+html_export_head(FILE *out)
+{
+	struct outbuf b;
+	char space[BUFSIZ];
+	char *realname = get_real_name(), *title, *str;
+	int i;
 
-		if (strcmp(str, "") == 0)
-			fprintf(out, "&nbsp;");
+	html_compile_columns(opt_get_str(STR_INDEX_FORMAT));
+
+	title = strdup_printf(_("%s's addressbook"), realname);
+
+	outbuf_init(&b, out, space, sizeof(space));
+	outbuf_literal(&b, "<!DOCTYPE html>\n");
+	outbuf_literal(&b, "<html>\n");
+	outbuf_literal(&b, "<head>\n");
+	outbuf_literal(&b, " <meta charset=\"utf-8\" />\n");
+	outbuf_literal(&b, " <title>");
+	outbuf_escaped(&b, title, strlen(title), html_escape);
+	outbuf_literal(&b, "</title>\n");
+	outbuf_literal(&b, " <style type=\"text/css\">\n");
+	outbuf_literal(&b, "  table {border-collapse: collapse ; border: 1px solid #000;}\n");
+	outbuf_literal(&b, "  table th, table td {text-align: left; border: 1px solid #000; padding: 0.33em;}\n");
+	outbuf_literal(&b, "  table th {border-bottom: 3px double #000; background-color: #ccc;}\n");
+	outbuf_literal(&b, " </style>\n");
+	outbuf_literal(&b, "</head>\n");
+	outbuf_literal(&b, "<body>\n");
+	outbuf_literal(&b, "<h1>");
+	outbuf_escaped(&b, title, strlen(title), html_escape);
+	outbuf_literal(&b, "</h1>\n");
+
+	outbuf_literal(&b, "<table>\n");
+	outbuf_literal(&b, "<thead>\n");
+	outbuf_literal(&b, " <tr>\n");
+	for(i = 0; i < html_columns_count; i++) {
+		get_field_info(html_fields[html_columns[i].first].id,
+				NULL, &str, NULL);
+
+		outbuf_literal(&b, "  <th>");
+		if(!*str)
+			outbuf_literal(&b, "&nbsp;");
 		else
-			fprintf(out, "%s", str);
-
-		fprintf(out, "</th>\n");
+			outbuf_escaped(&b, str, strlen(str), html_escape);
+		outbuf_literal(&b, "</th>\n");
 	}
-	fprintf(out, " </tr>\n");
-	fprintf(out, "<thead>\n");
-	fprintf(out, "<tbody>\n");
+	outbuf_literal(&b, " </tr>\n");
+	outbuf_literal(&b, "</thead>\n");
+	outbuf_literal(&b, "<tbody>\n");
+	outbuf_flush(&b);
 
+	free(title);
 	free(realname);
 }
 
+static void
+html_export_item(FILE *out, int item, int n)
+{
+	struct outbuf b;
+	char space[BUFSIZ];
+
+	outbuf_init(&b, out, space, sizeof(space));
+	html_put_item(&b, item);
+	outbuf_flush(&b);
+}
+
 static void
 html_export_write_tail(FILE *out)
 {
+	fprintf(out, "</tbody>\n");
 	fprintf(out, "</table>\n");
 	fprintf(out, "</body>\n");
 	fprintf(out, "</html>");
 }
 
+static int
+html_export_database(FILE *out, struct db_enumerator e)
+{
+	struct outbuf b;
+	int ret;
+
+	html_export_head(out);
+
+	outbuf_init(&b, out, NULL, OUTBUF_BLOCK);
+	db_enumerate_items(e)
+		html_put_item(&b, e.item);
+	ret = outbuf_flush(&b);
+	outbuf_free(&b);
+
+	html_export_write_tail(out);
+
+	return ret;
+}
+
 /*
  * end of html export filter
  */
@@ -1222,8 +2418,7 @@ pine_parse_buf(char *buf)
 	}
 
 	pine_convert_emails(item_fget(item, EMAIL));
-	add_item2database(item);
-	item_free(&item);
+	db_adopt_item(item);
 }
 
 
@@ -1280,22 +2475,37 @@ pine_parse_file(FILE *in)
  *  created files without problems - JH
  */
 
+static void
+pine_export_item(FILE *out, int item, int n)
+{
+	struct db_email_iter em = init_db_email_iter(item), count = em;
+	int n_emails = 0;
+
+	while(n_emails < 2 && db_email_iter_next(&count))
+		n_emails++;
+
+	fprintf(out, "%s\t%s\t",
+			safe_str(db_fget(item, NICK)),
+			safe_str(db_name_get(item)));
+
+	if(n_emails > 1) /* multiple addresses */
+		fputc('(', out);
+	n_emails = 0;
+	db_enumerate_emails(em)
+		fprintf(out, n_emails++ ? ",%.*s" : "%.*s", em.len, em.email);
+	if(n_emails > 1)
+		fputc(')', out);
+
+	fprintf(out, "\t\t%s\n", safe_str(db_fget(item, NOTES)));
+}
+
 static int
 pine_export_database(FILE *out, struct db_enumerator e)
 {
-	char *emails;
+	int n = 0;
 
-	db_enumerate_items(e) {
-		emails = db_email_get(e.item);
-		fprintf(out, strchr(emails, ',') /* multiple addresses? */ ?
-				"%s\t%s\t(%s)\t\t%s\n" : "%s\t%s\t%s\t\t%s\n",
-				safe_str(db_fget(e.item, NICK)),
-				safe_str(db_name_get(e.item)),
-				emails,
-				safe_str(db_fget(e.item, NOTES))
-				);
-		free(emails);
-	}
+	db_enumerate_items(e)
+		pine_export_item(out, e.item, n++);
 
 	return 0;
 }
@@ -1513,24 +2723,26 @@ csv_parse_line(char *line, int *table_base, size_t table_size)
 		start);
 
 	csv_convert_emails(item_fget(item, EMAIL));
-	add_item2database(item);
-	item_free(&item);
+	db_adopt_item(item);
 }
 
 static int
 csv_parse_file_common(FILE *in, int *conv_table, size_t table_size)
 {
-	char *line = NULL;
+	struct line_reader r;
+	char *line;
 
-	while(!feof(in)) {
-		line = getaline(in);
+	line_reader_init(&r, in);
+
+	while(!line_reader_eof(&r)) {
+		line = line_reader_read(&r);
 
 		if(line && *line && *line != CSV_COMMENT_CHAR)
 			csv_parse_line(line, conv_table, table_size);
-
-		xfree(line);
 	}
 
+	line_reader_free(&r);
+
 	return 0;
 }
 
@@ -1788,45 +3000,40 @@ vcard_parse_line(list_item item, char *line)
 }
 
 static void
-vcard_parse_item(FILE *in)
+vcard_parse_item(struct line_reader *r)
 {
-	char *line = NULL;
+	char *line;
 	list_item item = item_create();
 
-	while(!feof(in)) {
-		line = getaline(in);
+	while(!line_reader_eof(r)) {
+		line = line_reader_read(r);
 
-		if(line && !strncmp("END:VCARD", line, 9)) {
-			xfree(line);
+		if(line && !strncmp("END:VCARD", line, 9))
 			break;
-		}
-		else if(line) {
+		else if(line)
 			vcard_parse_line(item, line);
-			xfree(line);
-		}
 	}
 
-	add_item2database(item);
-	item_free(&item);
+	db_adopt_item(item);
 }
 
 static int
 vcard_parse_file(FILE *in)
 {
-	char *line = NULL;
+	struct line_reader r;
+	char *line;
 
-	while(!feof(in)) {
-		line = getaline(in);
+	line_reader_init(&r, in);
 
-		if(line && !strncmp("BEGIN:VCARD", line, 11)) {
-			xfree(line);
-			vcard_parse_item(in);
-		}
-		else if(line) {
-			xfree(line);
-		}
+	while(!line_reader_eof(&r)) {
+		line = line_reader_read(&r);
+
+		if(line && !strncmp("BEGIN:VCARD", line, 11))
+			vcard_parse_item(&r);
 	}
 
+	line_reader_free(&r);
+
 	return 0;
 }
 
@@ -1834,6 +3041,176 @@ vcard_parse_file(FILE *in)
  * end of vCard import filter
  */
 
+/*
+ * format guessing import filter
+ */
+
+#define SNIFF_LEN	4096
+
+/* number of comma separated fields of a csv line */
+static int
+csv_count_fields(char *line)
+{
+	char *p;
+	int n = 1;
+	bool in_quote = FALSE;
+
+	for(p = line; *p && *p != '\n'; p++) {
+		if(*p == '\"')
+			in_quote = !in_quote;
+		else if(*p == ',' && !in_quote)
+			n++;
+	}
+
+	return n;
+}
+
+/*
+ * Looks at the first significant line of buf, which holds the beginning
+ * of the input, and returns the name of the input filter able to read it.
+ */
+static char *
+guess_input_format(char *buf)
+{
+	char *line, *next;
+	int n;
+
+	for(line = buf; *line; line = next) {
+		if((next = strchr(line, '\n')) != NULL)
+			next++;
+		else
+			next = line + strlen(line);
+
+		/* utf-8 byte order mark */
+		if(line == buf && !strncmp(line, "\xef\xbb\xbf", 3))
+			line += 3;
+
+		if(!strncmp(line, "#\"", 2)) /* header of an allcsv export */
+			return "allcsv";
+
+		if(*line == '\n' || *line == '\r' || *line == '#')
+			continue;
+
+		if(*line == '[')
+			return "abook";
+		if(!strncasecmp(line, "dn:", 3) ||
+				!strncasecmp(line, "version:", 8))
+			return "ldif";
+		if(!strncasecmp(line, "BEGIN:VCARD", 11))
+			return "vcard";
+		if(!strncmp(line, "alias ", 6) || !strncmp(line, "alias\t", 6))
+			return "mutt";
+		if(memchr(line, '\t', next - line))
+			return "pine";
+		if(memchr(line, ',', next - line) || *line == '\"') {
+			n = csv_count_fields(line);
+			if(n > (int)CSV_TABLE_SIZE(allcsv_conv_table))
+				return "palmcsv";
+			if(n > (int)CSV_TABLE_SIZE(csv_conv_table))
+				return "allcsv";
+			return "csv";
+		}
+
+		return NULL;
+	}
+
+	return NULL;
+}
+
+/*
+ * The input may not be seekable (stdin): what was read to guess its
+ * format is then replayed in front of the rest.
+ */
+
+#ifdef HAVE_FOPENCOOKIE
+struct sniff_replay {
+	char *buf;
+	size_t len;
+	size_t pos;
+	FILE *in;
+};
+
+static ssize_t
+sniff_replay_read(void *cookie, char *out, size_t size)
+{
+	struct sniff_replay *r = cookie;
+	size_t n;
+
+	if(r->pos < r->len) {
+		n = min(size, r->len - r->pos);
+		memcpy(out, r->buf + r->pos, n);
+		r->pos += n;
+		return n;
+	}
+
+	return fread(out, 1, size, r->in);
+}
+
+static int
+replay_parse_file(int filter, FILE *in, char *buf, size_t len)
+{
+	struct sniff_replay r = { buf, len, 0, in };
+	cookie_io_functions_t io = { sniff_replay_read, NULL, NULL, NULL };
+	FILE *f;
+	int ret;
+
+	if((f = fopencookie(&r, "r", io)) == NULL)
+		return 1;
+
+	ret = (*i_filters[filter].func) (f);
+	fclose(f);
+
+	return ret;
+}
+#else
+static int
+replay_parse_file(int filter, FILE *in, char *buf, size_t len)
+{
+	FILE *f;
+	int ret;
+
+	if((f = tmpfile()) == NULL)
+		return 1;
+
+	fwrite(buf, 1, len, f);
+	while((len = fread(buf, 1, SNIFF_LEN, in)) > 0)
+		fwrite(buf, 1, len, f);
+	rewind(f);
+
+	ret = (*i_filters[filter].func) (f);
+	fclose(f);
+
+	return ret;
+}
+#endif
+
+static int
+auto_parse_file(FILE *in)
+{
+	char buf[SNIFF_LEN + 1];
+	char *format;
+	size_t len;
+	long pos;
+	int filter;
+
+	pos = ftell(in);
+	len = fread(buf, 1, SNIFF_LEN, in);
+	buf[len] = 0;
+
+	if((format = guess_input_format(buf)) == NULL ||
+			(filter = find_input_filter(format)) < 0)
+		return 1;
+
+	if(pos != -1 && !fseek(in, pos, SEEK_SET))
+		return (*i_filters[filter].func) (in);
+
+	return replay_parse_file(filter, in, buf, len);
+}
+
+/*
+ * end of format guessing import filter
+ */
+
 /*
  * csv addressbook export filters
  */
@@ -1843,87 +3220,151 @@ vcard_parse_file(FILE *in)
 #define CSV_SPECIAL(X)		(-3 - (X))
 #define CSV_IS_SPECIAL(X)	((X) <= -3)
 
-static int
-csv_export_common(FILE *out, struct db_enumerator e,
-		int fields[], void (*special_func)(FILE *, int, int))
+static void
+csv_put_value(struct outbuf *b, char *value)
+{
+	outbuf_putc(b, '\"');
+	outbuf_puts(b, safe_str(value));
+	outbuf_putc(b, '\"');
+}
+
+static void
+csv_put_line(struct outbuf *b, int item,
+		int fields[], void (*special_func)(struct outbuf *, int, int))
 {
 	int i;
 
-	db_enumerate_items(e) {
-		for(i = 0; fields[i] != CSV_LAST; i++) {
-			if(fields[i] == CSV_UNDEFINED)
-				fprintf(out, "\"\"");
-			else if(CSV_IS_SPECIAL(fields[i])) {
-				if(special_func)
-					(*special_func)(out, e.item, fields[i]);
-			}
-			else if(fields[i] >= CUSTOM_FIELD_START_INDEX) {
-				fprintf(out, "\"%s\"",
-					safe_str(db_fget_byid(e.item, fields[i] - CUSTOM_FIELD_START_INDEX)));
-			}
-			else
-				/*fprintf(out,(
-			strchr(safe_str(database[e.item][field_idx(fields[i])]), ',') ||
-			strchr(safe_str(database[e.item][field_idx(fields[i])]), '\"')) ?
-				"\"%s\"" : "%s",
-				safe_str(database[e.item][field_idx(fields[i])])
-				);*/
-				fprintf(out, "\"%s\"",
-					safe_str(db_fget(e.item,fields[i])));
-
-			if(fields[i + 1] != CSV_LAST)
-				fputc(',', out);
+	for(i = 0; fields[i] != CSV_LAST; i++) {
+		if(fields[i] == CSV_UNDEFINED)
+			outbuf_literal(b, "\"\"");
+		else if(CSV_IS_SPECIAL(fields[i])) {
+			if(special_func)
+				(*special_func)(b, item, fields[i]);
 		}
-		fputc('\n', out);
+		else if(fields[i] >= CUSTOM_FIELD_START_INDEX)
+			csv_put_value(b, db_fget_byid(item,
+					fields[i] - CUSTOM_FIELD_START_INDEX));
+		else
+			csv_put_value(b, db_fget(item, fields[i]));
+
+		if(fields[i + 1] != CSV_LAST)
+			outbuf_putc(b, ',');
 	}
+	outbuf_putc(b, '\n');
+}
 
-	return 0;
+static void
+csv_export_line(FILE *out, int item,
+		int fields[], void (*special_func)(struct outbuf *, int, int))
+{
+	struct outbuf b;
+	char space[BUFSIZ];
+
+	outbuf_init(&b, out, space, sizeof(space));
+	csv_put_line(&b, item, fields, special_func);
+	outbuf_flush(&b);
 }
 
 static int
-csv_export_database(FILE *out, struct db_enumerator e)
+csv_export_common(FILE *out, struct db_enumerator e,
+		int fields[], void (*special_func)(struct outbuf *, int, int))
 {
-	int csv_export_fields[] = {
-		NAME,
-		EMAIL,
-		PHONE,
-		NOTES,
-		NICK,
-		CSV_LAST
-	};
+	struct outbuf b;
+	int ret;
 
-	csv_export_common(out, e, csv_export_fields, NULL);
+	outbuf_init(&b, out, NULL, OUTBUF_BLOCK);
 
-	return 0;
+	db_enumerate_items(e)
+		csv_put_line(&b, e.item, fields, special_func);
+
+	ret = outbuf_flush(&b);
+	outbuf_free(&b);
+
+	return ret;
+}
+
+static int csv_export_fields[] = {
+	NAME,
+	EMAIL,
+	PHONE,
+	NOTES,
+	NICK,
+	CSV_LAST
+};
+
+static void
+csv_export_item(FILE *out, int item, int n)
+{
+	csv_export_line(out, item, csv_export_fields, NULL);
 }
 
 static int
-allcsv_export_database(FILE *out, struct db_enumerator e)
+csv_export_database(FILE *out, struct db_enumerator e)
 {
-	/*
-	 * TODO: Should get these atomatically from abook_fileds
-	 *  - JH
-	 */
-	int allcsv_export_fields[ITEM_FIELDS + 6] = { // only the 5 custom fields are allowed so far
-		NAME,
-		EMAIL,
-		ADDRESS,
-		ADDRESS2,
-		CITY,
-		STATE,
-		ZIP,
-		COUNTRY,
-		PHONE,
-		WORKPHONE,
-		FAX,
-		MOBILEPHONE, // spelt "mobile" in standard_fields
-		NICK,
-		URL,
-		NOTES,
-		ANNIVERSARY,
-		GROUPS,
-		CSV_LAST
-	};
+	return csv_export_common(out, e, csv_export_fields, NULL);
+}
+
+/*
+ * TODO: Should get these atomatically from abook_fileds
+ *  - JH
+ */
+static int allcsv_export_fields[ITEM_FIELDS + 6] = { // only the 5 custom fields are allowed so far
+	NAME,
+	EMAIL,
+	ADDRESS,
+	ADDRESS2,
+	CITY,
+	STATE,
+	ZIP,
+	COUNTRY,
+	PHONE,
+	WORKPHONE,
+	FAX,
+	MOBILEPHONE, // spelt "mobile" in standard_fields
+	NICK,
+	URL,
+	NOTES,
+	ANNIVERSARY,
+	GROUPS,
+	CSV_LAST
+};
+
+/* the columns of allcsv_export_item(), set by allcsv_export_head() */
+static int *allcsv_columns = allcsv_export_fields;
+static int *allcsv_projected_columns = NULL;
+
+/* the exported fields are given by db_set_projection() */
+static void
+allcsv_export_projected_head(FILE *out, int *ids, int n)
+{
+	char *key;
+	int i;
+
+	allcsv_projected_columns = xrealloc(allcsv_projected_columns,
+			sizeof(int) * (n + 1));
+
+	fprintf(out, "#");
+	for(i = 0; i < n; i++) {
+		get_field_info(ids[i], &key, NULL, NULL);
+		fprintf(out, i ? ",\"%s\"" : "\"%s\"", key);
+		allcsv_projected_columns[i] = ids[i] + CUSTOM_FIELD_START_INDEX;
+	}
+	allcsv_projected_columns[n] = CSV_LAST;
+	fprintf(out, "\n");
+
+	allcsv_columns = allcsv_projected_columns;
+}
+
+static void
+allcsv_export_head(FILE *out)
+{
+	int *ids, n;
+
+	if((n = db_get_projection(&ids)) >= 0) {
+		allcsv_export_projected_head(out, ids, n);
+		return;
+	}
+	allcsv_columns = allcsv_export_fields;
 
 	fprintf(out, "#");
 	int i = 0;
@@ -1953,6 +3394,8 @@ allcsv_export_database(FILE *out, struct db_enumerator e)
 	// name of the defined field <field_no> as chosen by the user
 	char *custom_field_name;
 
+	allcsv_export_fields[append_field] = CSV_LAST;
+
 	for (j = 1; j <= 5; j++) {
 		snprintf(custom_field_key, 8, "custom%d", j++);
 		if(find_declared_field(custom_field_key)) {
@@ -1965,12 +3408,22 @@ allcsv_export_database(FILE *out, struct db_enumerator e)
 			fprintf(out, ",\"%s\"", custom_field_name);
 		}
 	}
-	free(custom_field_name);
 	fprintf(out, "\n");
+}
+
+/* allcsv_export_head() must have been called first */
+static void
+allcsv_export_item(FILE *out, int item, int n)
+{
+	csv_export_line(out, item, allcsv_columns, NULL);
+}
 
-	csv_export_common(out, e, allcsv_export_fields, NULL);
+static int
+allcsv_export_database(FILE *out, struct db_enumerator e)
+{
+	allcsv_export_head(out);
 
-	return 0;
+	return csv_export_common(out, e, allcsv_columns, NULL);
 }
 
 /*
@@ -1982,7 +3435,7 @@ allcsv_export_database(FILE *out, struct db_enumerator e)
 #define PALM_CSV_CAT	CSV_SPECIAL(2)
 
 static void
-palm_split_and_write_name(FILE *out, char *name)
+palm_split_and_write_name(struct outbuf *b, char *name)
 {
 	char *p;
 
@@ -1992,62 +3445,70 @@ palm_split_and_write_name(FILE *out, char *name)
 		/*
 		 * last name first
 		 */
-		fprintf(out, "\"%s\",\"" , p + 1);
-		fwrite((void *)name, p - name, sizeof(char), out);
-		fputc('\"', out);
+		outbuf_putc(b, '\"');
+		outbuf_puts(b, p + 1);
+		outbuf_literal(b, "\",\"");
+		outbuf_add(b, name, p - name);
+		outbuf_putc(b, '\"');
 	} else {
-		fprintf(out, "\"%s\"", safe_str(name));
+		csv_put_value(b, name);
 	}
 }
 
 static void
-palm_csv_handle_specials(FILE *out, int item, int field)
+palm_csv_handle_specials(struct outbuf *b, int item, int field)
 {
 	switch(field) {
 		case PALM_CSV_NAME:
-			palm_split_and_write_name(out, db_name_get(item));
+			palm_split_and_write_name(b, db_name_get(item));
 			break;
 		case PALM_CSV_CAT:
-			fprintf(out, "\"abook\"");
+			outbuf_literal(b, "\"abook\"");
 			break;
 		case PALM_CSV_END:
-			fprintf(out, "\"0\"");
+			outbuf_literal(b, "\"0\"");
 			break;
 		default:
 			assert(0);
 	}
 }
 
+static int palm_export_fields[] = {
+	PALM_CSV_NAME,		/* LASTNAME, FIRSTNAME 	*/
+	CSV_UNDEFINED,		/* TITLE   		*/
+	CSV_UNDEFINED, 		/* COMPANY 		*/
+	WORKPHONE,		/* WORK PHONE 		*/
+	PHONE,			/* HOME PHONE		*/
+	FAX,			/* FAX			*/
+	MOBILEPHONE, 		/* OTHER 		*/
+	EMAIL,			/* EMAIL		*/
+	ADDRESS,		/* ADDRESS		*/
+	CITY,			/* CITY			*/
+	STATE,			/* STATE		*/
+	ZIP,			/* ZIP			*/
+	COUNTRY,		/* COUNTRY		*/
+	NICK, 			/* DEFINED 1		*/
+	URL, 			/* DEFINED 2 		*/
+	CSV_UNDEFINED,		/* DEFINED 3		*/
+	CSV_UNDEFINED,		/* DEFINED 4 		*/
+	NOTES,			/* NOTE			*/
+	PALM_CSV_END,		/* "0" 			*/
+	PALM_CSV_CAT,		/* CATEGORY 		*/
+	CSV_LAST
+};
+
+static void
+palm_export_item(FILE *out, int item, int n)
+{
+	csv_export_line(out, item, palm_export_fields,
+			palm_csv_handle_specials);
+}
+
 static int
 palm_export_database(FILE *out, struct db_enumerator e)
 {
-	int palm_export_fields[] = {
-		PALM_CSV_NAME,		/* LASTNAME, FIRSTNAME 	*/
-		CSV_UNDEFINED,		/* TITLE   		*/
-		CSV_UNDEFINED, 		/* COMPANY 		*/
-		WORKPHONE,		/* WORK PHONE 		*/
-		PHONE,			/* HOME PHONE		*/
-		FAX,			/* FAX			*/
-		MOBILEPHONE, 		/* OTHER 		*/
-		EMAIL,			/* EMAIL		*/
-		ADDRESS,		/* ADDRESS		*/
-		CITY,			/* CITY			*/
-		STATE,			/* STATE		*/
-		ZIP,			/* ZIP			*/
-		COUNTRY,		/* COUNTRY		*/
-        	NICK, 			/* DEFINED 1		*/
-        	URL, 			/* DEFINED 2 		*/
-		CSV_UNDEFINED,		/* DEFINED 3		*/
-		CSV_UNDEFINED,		/* DEFINED 4 		*/
-		NOTES,			/* NOTE			*/
-		PALM_CSV_END,		/* "0" 			*/
-		PALM_CSV_CAT,		/* CATEGORY 		*/
-		CSV_LAST
-	};
-
-	csv_export_common(out, e, palm_export_fields, palm_csv_handle_specials);
-
-	return 0;
+	return csv_export_common(out, e, palm_export_fields,
+			palm_csv_handle_specials);
 }
 
 /*
@@ -2058,89 +3519,126 @@ palm_export_database(FILE *out, struct db_enumerator e)
  * vCard 2 addressbook export filter
  */
 
+static void	vcard_put_item(struct outbuf *b, int item);
+
 static int
 vcard_export_database(FILE *out, struct db_enumerator e)
 {
-  db_enumerate_items(e)
-    vcard_export_item(out, e.item);
-  return 0;
+	struct outbuf b;
+	int ret;
+
+	outbuf_init(&b, out, NULL, OUTBUF_BLOCK);
+
+	db_enumerate_items(e)
+		vcard_put_item(&b, e.item);
+
+	ret = outbuf_flush(&b);
+	outbuf_free(&b);
+
+	return ret;
+}
+
+static void
+vcard_stream_item(FILE *out, int item, int n)
+{
+	vcard_export_item(out, item);
 }
 
 void
 vcard_export_item(FILE *out, int item)
 {
-	int j, email_no;
-	char *name, *tmp;
-	abook_list *emails, *em;
-	fprintf(out, "BEGIN:VCARD\r\nFN:%s\r\n",
-		safe_str(db_name_get(item)));
+	struct outbuf b;
+	char space[BUFSIZ];
+
+	outbuf_init(&b, out, space, sizeof(space));
+	vcard_put_item(&b, item);
+	outbuf_flush(&b);
+}
+
+/* writes "<prefix><value>\r\n" */
+static void
+vcard_put_line(struct outbuf *b, char *prefix, char *value)
+{
+	outbuf_puts(b, prefix);
+	outbuf_puts(b, value);
+	outbuf_literal(b, "\r\n");
+}
+
+static void
+vcard_put_item(struct outbuf *b, int item)
+{
+	int j, email_no = 0;
+	char *name;
+	struct db_email_iter em = init_db_email_iter(item);
+
+	vcard_put_line(b, "BEGIN:VCARD\r\nFN:", safe_str(db_name_get(item)));
 
 	name = get_surname(db_name_get(item));
 	for( j = strlen(db_name_get(item)) - 1; j >= 0; j-- ) {
 	  if((db_name_get(item))[j] == ' ')
 	    break;
 	}
-	fprintf(out, "N:%s;%.*s\r\n",
-		safe_str(name),
-		j,
-		safe_str(db_name_get(item))
-		);
+	outbuf_literal(b, "N:");
+	outbuf_puts(b, safe_str(name));
+	outbuf_putc(b, ';');
+	// no space: the whole name
+	outbuf_add(b, db_name_get(item),
+			(j < 0) ? strlen(db_name_get(item)) : (size_t)j);
+	outbuf_literal(b, "\r\n");
 
 	free(name);
 
 	if(db_fget(item, NICK))
-	  fprintf(out, "NICKNAME:%s\r\n",
-		  safe_str(db_fget(item, NICK)));
+	  vcard_put_line(b, "NICKNAME:", db_fget(item, NICK));
 	if(db_fget(item, ANNIVERSARY))
-	  fprintf(out, "BDAY:%s\r\n",
-		  safe_str(db_fget(item, ANNIVERSARY)));
+	  vcard_put_line(b, "BDAY:", db_fget(item, ANNIVERSARY));
 
 	// see rfc6350 section 6.3.1
 	if(db_fget(item, ADDRESS)) {
-		fprintf(out, "ADR:;%s;%s;%s;%s;%s;%s\r\n",
-		        // pobox (unsupported)
-		        safe_str(db_fget(item, ADDRESS2)), // ext (n°, ...)
-		        safe_str(db_fget(item, ADDRESS)), // street
-		        safe_str(db_fget(item, CITY)), // locality
-		        safe_str(db_fget(item, STATE)), // region
-		        safe_str(db_fget(item, ZIP)), // code (postal)
-		        safe_str(db_fget(item, COUNTRY)) // country
-		        );
+		outbuf_literal(b, "ADR:;");
+		// pobox (unsupported)
+		outbuf_puts(b, safe_str(db_fget(item, ADDRESS2))); // ext (n°, ...)
+		outbuf_putc(b, ';');
+		outbuf_puts(b, safe_str(db_fget(item, ADDRESS))); // street
+		outbuf_putc(b, ';');
+		outbuf_puts(b, safe_str(db_fget(item, CITY))); // locality
+		outbuf_putc(b, ';');
+		outbuf_puts(b, safe_str(db_fget(item, STATE))); // region
+		outbuf_putc(b, ';');
+		outbuf_puts(b, safe_str(db_fget(item, ZIP))); // code (postal)
+		outbuf_putc(b, ';');
+		outbuf_puts(b, safe_str(db_fget(item, COUNTRY))); // country
+		outbuf_literal(b, "\r\n");
 	}
 
 	if(db_fget(item, PHONE))
-	  fprintf(out, "TEL;HOME:%s\r\n",
-		  db_fget(item, PHONE));
+	  vcard_put_line(b, "TEL;HOME:", db_fget(item, PHONE));
 	if(db_fget(item, WORKPHONE))
-	  fprintf(out, "TEL;WORK:%s\r\n",
-		  db_fget(item, WORKPHONE));
+	  vcard_put_line(b, "TEL;WORK:", db_fget(item, WORKPHONE));
 	if(db_fget(item, FAX))
-	  fprintf(out, "TEL;FAX:%s\r\n",
-		  db_fget(item, FAX));
+	  vcard_put_line(b, "TEL;FAX:", db_fget(item, FAX));
 	if(db_fget(item, MOBILEPHONE))
-	  fprintf(out, "TEL;CELL:%s\r\n",
-		  db_fget(item, MOBILEPHONE));
-
-	tmp = db_email_get(item);
-	if(*tmp) {
-	  emails = csv_to_abook_list(tmp);
-	  fprintf(out, "EMAIL;PREF;INTERNET:%s\r\n", emails->data);
-	  email_no = 1;
-	  for(em = emails->next; em; em = em->next, email_no++ )
-		  fprintf(out, "EMAIL;%d;INTERNET:%s\r\n", email_no, em->data);
-
-	  abook_list_free(&emails);
+	  vcard_put_line(b, "TEL;CELL:", db_fget(item, MOBILEPHONE));
+
+	db_enumerate_emails(em) {
+	  if(!email_no)
+		  outbuf_literal(b, "EMAIL;PREF;INTERNET:");
+	  else {
+		  outbuf_literal(b, "EMAIL;");
+		  outbuf_int(b, email_no);
+		  outbuf_literal(b, ";INTERNET:");
+	  }
+	  outbuf_add(b, em.email, em.len);
+	  outbuf_literal(b, "\r\n");
+	  email_no++;
 	}
-	free(tmp);
 
 	if(db_fget(item, NOTES))
-	  fprintf(out, "NOTE:%s\r\n",
-		  db_fget(item, NOTES));
+	  vcard_put_line(b, "NOTE:", db_fget(item, NOTES));
 	if(db_fget(item, URL))
-	  fprintf(out, "URL:%s\r\n",
-		  db_fget(item, URL));
+	  vcard_put_line(b, "URL:", db_fget(item, URL));
 
-	fprintf(out, "END:VCARD\r\n\r\n");
+	outbuf_literal(b, "END:VCARD\r\n\r\n");
 
 }
 
@@ -2172,125 +3670,145 @@ mutt_alias_genalias(int i)
 }
 
 /*
- * This function is a variant of abook_list_to_csv
- * */
-static char *
-mutt_alias_gengroups(int i)
+ * Renders "-group g1 -group g2 " once per item; the string is
+ * repeated on every alias line of the item.
+ */
+static void
+mutt_alias_put_groups(struct outbuf *b, int item)
 {
-	char *groups, *res = NULL;
-	char groupstr[7] = "-group ";
-	abook_list *list, *tmp;
+	/* groups are a comma separated list, same as the addresses */
+	struct db_email_iter g = init_email_iter(db_fget(item, GROUPS));
 
-	groups = db_fget(i, GROUPS);
+	db_enumerate_emails(g) {
+		outbuf_literal(b, "-group ");
+		outbuf_add(b, g.email, g.len);
+		outbuf_putc(b, ' ');
+	}
+}
 
-	if(!groups)
-		return NULL;
+static void
+mutt_alias_put_item(struct outbuf *b, int item)
+{
+	struct db_email_iter em = init_db_email_iter(item);
+	struct outbuf groups;
+	char space[BUFSIZ];
+	char *alias, *name;
+	int first = 1;
+
+	/* do not output contacts without email address */
+	/* cause this does not make sense in mutt aliases */
+	if(!db_email_iter_next(&em))
+		return;
 
-	list = csv_to_abook_list(groups);
-	for(tmp = list; tmp; tmp = tmp->next) {
-		if(tmp == list) {
-			res = xmalloc(strlen(groupstr)+strlen(tmp->data)+1);
-			res = strcpy(res, groupstr);
+	alias = (field_id(NICK) != -1) ? mutt_alias_genalias(item) : NULL;
+	name = safe_str(db_name_get(item));
+
+	outbuf_init(&groups, NULL, space, sizeof(space));
+	if(field_id(GROUPS) != -1)
+		mutt_alias_put_groups(&groups, item);
+
+	do {
+		outbuf_literal(b, "alias ");
+		outbuf_add(b, groups.data, groups.len);
+		if(first) {
+			if(alias) {
+				outbuf_puts(b, alias);
+				outbuf_putc(b, ' ');
+			}
+			first = 0;
 		} else {
-			res = xrealloc(res, strlen(res)+1+strlen(groupstr)+strlen(tmp->data)+1);
-			strcat(res, " ");
-			strcat(res, groupstr);
+			outbuf_puts(b, alias ? alias : name);
+			outbuf_literal(b, "__");
+			outbuf_add(b, em.email, em.len);
+			outbuf_putc(b, ' ');
 		}
-		strcat(res, tmp->data);
-	}
-	abook_list_free(&list);
-	xfree(groups);
+		outbuf_puts(b, name);
+		outbuf_literal(b, " <");
+		outbuf_add(b, em.email, em.len);
+		outbuf_literal(b, ">\n");
+	} while(db_email_iter_next(&em));
+
+	outbuf_free(&groups);
+	xfree(alias);
+}
+
+static void
+mutt_alias_export_item(FILE *out, int item, int n)
+{
+	struct outbuf b;
+	char space[BUFSIZ];
 
-	return res;
+	outbuf_init(&b, out, space, sizeof(space));
+	mutt_alias_put_item(&b, item);
+	outbuf_flush(&b);
 }
 
 static int
 mutt_alias_export(FILE *out, struct db_enumerator e)
 {
-	char email[MAX_EMAIL_LEN];
-	char *alias = NULL;
-	char *groups = NULL;
-	int email_addresses;
-	char *ptr;
-
-	db_enumerate_items(e) {
-		alias = (field_id(NICK) != -1) ? mutt_alias_genalias(e.item) : NULL;
-		groups = (field_id(GROUPS) != -1) ?  mutt_alias_gengroups(e.item) : NULL;
-		get_first_email(email, e.item);
-
-		/* do not output contacts without email address */
-		/* cause this does not make sense in mutt aliases */
-		if (*email) {
-
-			/* output first email address */
-			fprintf(out,"alias ");
-			if(groups)
-				fprintf(out, "%s ", groups);
-			if(alias)
-				fprintf(out, "%s ", alias);
-			fprintf(out, "%s <%s>\n",
-					db_name_get(e.item),
-					email);
-
-			/* number of email addresses */
-			email_addresses = 1;
-			ptr = db_email_get(e.item);
-			while (*ptr != '\0') {
-				if (*ptr == ',') {
-					email_addresses++;
-				}
-				ptr++;
-			}
+	struct outbuf b;
+	int ret;
+
+	outbuf_init(&b, out, NULL, OUTBUF_BLOCK);
+	db_enumerate_items(e)
+		mutt_alias_put_item(&b, e.item);
+	ret = outbuf_flush(&b);
+	outbuf_free(&b);
+	return ret;
+}
 
-			/* output other email addresses */
-			while (email_addresses-- > 1) {
-				roll_emails(e.item, ROTATE_RIGHT);
-				get_first_email(email, e.item);
-				fprintf(out,"alias ");
-				if( groups )
-					fprintf(out, "%s ", groups);
-				if(alias)
-					fprintf(out, "%s__%s ", alias, email);
-				else
-					fprintf(out, "%s__%s ", db_name_get(e.item), email);
-				fprintf(out, "%s <%s>\n",
-						db_name_get(e.item),
-						email);
-			}
-			roll_emails(e.item, ROTATE_RIGHT);
-			xfree(alias);
-			xfree(groups);
-		}
+static void
+muttq_put_item(struct outbuf *b, int item)
+{
+	struct db_email_iter em = init_db_email_iter(item);
+
+	db_enumerate_emails(em) {
+		outbuf_add(b, em.email, em.len);
+		outbuf_putc(b, '\t');
+		outbuf_puts(b, safe_str(db_name_get(item)));
+		outbuf_putc(b, '\t');
+		outbuf_puts(b, !db_fget(item, NOTES) ? " " : db_fget(item, NOTES));
+		outbuf_putc(b, '\n');
+		if(!opt_get_bool(BOOL_MUTT_RETURN_ALL_EMAILS))
+			break;
 	}
-
-	return 0;
 }
 
 void muttq_print_item(FILE *file, int item)
 {
-	abook_list *emails, *e;
-	char *tmp = db_email_get(item);
+	struct outbuf b;
+	char space[BUFSIZ];
 
-	emails = csv_to_abook_list(tmp);
-	free(tmp);
+	outbuf_init(&b, file, space, sizeof(space));
+	muttq_put_item(&b, item);
+	outbuf_flush(&b);
+}
 
-	for(e = emails; e; e = e->next) {
-		fprintf(file, "%s\t%s\t%s\n", e->data, db_name_get(item),
-				!db_fget(item, NOTES) ?" " :db_fget(item, NOTES)
-				);
-		if(!opt_get_bool(BOOL_MUTT_RETURN_ALL_EMAILS))
-			break;
-	}
-	abook_list_free(&emails);
+static void
+mutt_query_export_head(FILE *out)
+{
+  fprintf(out, "All items\n");
+}
+
+static void
+mutt_query_export_item(FILE *out, int item, int n)
+{
+  muttq_print_item(out, item);
 }
 
 static int
 mutt_query_export_database(FILE *out, struct db_enumerator e)
 {
-  fprintf(out, "All items\n");
+  struct outbuf b;
+  int ret;
+
+  mutt_query_export_head(out);
+  outbuf_init(&b, out, NULL, OUTBUF_BLOCK);
   db_enumerate_items(e)
-    muttq_print_item(out, e.item);
-  return 0;
+    muttq_put_item(&b, e.item);
+  ret = outbuf_flush(&b);
+  outbuf_free(&b);
+  return ret;
 }
 
 /*
@@ -2366,74 +3884,89 @@ text_write_address_eu(FILE *out, int i) {
 		fprintf(out, "\n%s", db_fget(i, COUNTRY));
 }
 
-static int
-text_export_database(FILE * out, struct db_enumerator e)
+static void
+text_export_head(FILE *out)
 {
-	abook_list *emails, *em;
-	int j;
-	char *realname = get_real_name(), *str = NULL, *tmp;
-	char *style = opt_get_str(STR_ADDRESS_STYLE);
+	char *realname = get_real_name();
 
 	fprintf(out,
 		"-----------------------------------------\n%s's address book\n"
 		"-----------------------------------------\n\n\n",
 		realname);
 	free(realname);
+}
 
-	db_enumerate_items(e) {
-		fprintf(out,
-			"-----------------------------------------\n\n");
-		fprintf(out, "%s", db_name_get(e.item));
-		if(db_fget(e.item, NICK) && *db_fget(e.item, NICK))
-			fprintf(out, "\n(%s)", db_fget(e.item, NICK));
-		fprintf(out, "\n");
-
-		tmp = db_email_get(e.item);
-		if(*tmp) {
-			emails = csv_to_abook_list(tmp);
-
-			fprintf(out, "\n");
-			for(em = emails; em; em = em->next)
-				fprintf(out, "%s\n", em->data);
-
-			abook_list_free(&emails);
-		}
-		free(tmp);
-		/* Print address */
-		if(db_fget(e.item, ADDRESS)) {
-			if(!safe_strcmp(style, "us"))	/* US like */
-				text_write_address_us(out, e.item);
-			else if(!safe_strcmp(style, "uk"))	/* UK like */
-				text_write_address_uk(out, e.item);
-			else	/* EU like */
-				text_write_address_eu(out, e.item);
+static void
+text_export_item(FILE *out, int item, int n)
+{
+	struct db_email_iter em = init_db_email_iter(item);
+	int j, n_emails = 0;
+	char *str = NULL;
+	char *style = opt_get_str(STR_ADDRESS_STYLE);
 
-			fprintf(out, "\n");
-		}
+	fprintf(out,
+		"-----------------------------------------\n\n");
+	fprintf(out, "%s", db_name_get(item));
+	if(db_fget(item, NICK) && *db_fget(item, NICK))
+		fprintf(out, "\n(%s)", db_fget(item, NICK));
+	fprintf(out, "\n");
 
-		if((db_fget(e.item, PHONE)) ||
-			(db_fget(e.item, WORKPHONE)) ||
-			(db_fget(e.item, FAX)) ||
-			(db_fget(e.item, MOBILEPHONE))) {
+	db_enumerate_emails(em) {
+		if(!n_emails++)
 			fprintf(out, "\n");
-			for(j = PHONE; j <= MOBILEPHONE; j++)
-				if(db_fget(e.item, j)) {
-					get_field_info(field_id(j),
-							NULL, &str, NULL);
-					fprintf(out, "%s: %s\n", str,
-						db_fget(e.item, j));
-				}
-		}
+		fprintf(out, "%.*s\n", em.len, em.email);
+	}
+	/* Print address */
+	if(db_fget(item, ADDRESS)) {
+		if(!safe_strcmp(style, "us"))	/* US like */
+			text_write_address_us(out, item);
+		else if(!safe_strcmp(style, "uk"))	/* UK like */
+			text_write_address_uk(out, item);
+		else	/* EU like */
+			text_write_address_eu(out, item);
 
-		if(db_fget(e.item, URL))
-			fprintf(out, "\n%s\n", db_fget(e.item, URL));
-		if(db_fget(e.item, NOTES))
-			fprintf(out, "\n%s\n", db_fget(e.item, NOTES));
+		fprintf(out, "\n");
+	}
 
+	if((db_fget(item, PHONE)) ||
+		(db_fget(item, WORKPHONE)) ||
+		(db_fget(item, FAX)) ||
+		(db_fget(item, MOBILEPHONE))) {
 		fprintf(out, "\n");
+		for(j = PHONE; j <= MOBILEPHONE; j++)
+			if(db_fget(item, j)) {
+				get_field_info(field_id(j),
+						NULL, &str, NULL);
+				fprintf(out, "%s: %s\n", str,
+					db_fget(item, j));
+			}
 	}
 
+	if(db_fget(item, URL))
+		fprintf(out, "\n%s\n", db_fget(item, URL));
+	if(db_fget(item, NOTES))
+		fprintf(out, "\n%s\n", db_fget(item, NOTES));
+
+	fprintf(out, "\n");
+}
+
+static void
+text_export_tail(FILE *out)
+{
 	fprintf(out, "-----------------------------------------\n");
+}
+
+static int
+text_export_database(FILE * out, struct db_enumerator e)
+{
+	int n = 0;
+
+	text_export_head(out);
+
+	db_enumerate_items(e)
+		text_export_item(out, e.item, n++);
+
+	text_export_tail(out);
 
 	return 0;
 }
@@ -2446,18 +3979,25 @@ text_export_database(FILE * out, struct db_enumerator e)
  * elm alias export filter
  */
 
-static int
-elm_alias_export(FILE *out, struct db_enumerator e)
+static void
+elm_alias_export_item(FILE *out, int item, int n)
 {
 	char email[MAX_EMAIL_LEN];
 	char *alias = NULL;
 
-	db_enumerate_items(e) {
-		alias = mutt_alias_genalias(e.item);
-		get_first_email(email, e.item);
-		fprintf(out, "%s = %s = %s\n",alias,db_name_get(e.item),email);
-		xfree(alias);
-	}
+	alias = mutt_alias_genalias(item);
+	get_first_email(email, item);
+	fprintf(out, "%s = %s = %s\n",alias,db_name_get(item),email);
+	xfree(alias);
+}
+
+static int
+elm_alias_export(FILE *out, struct db_enumerator e)
+{
+	int n = 0;
+
+	db_enumerate_items(e)
+		elm_alias_export_item(out, e.item, n++);
 
 	return 0;
 }
@@ -2503,25 +4043,45 @@ spruce_export_database (FILE *out, struct db_enumerator e)
  * wanderlust addressbook export filter
  */
 
-static int
-wl_export_database(FILE *out, struct db_enumerator e)
+static void
+wl_export_head(FILE *out)
+{
+	fprintf(out, "# Wanderlust address book written by %s\n\n", PACKAGE);
+}
+
+static void
+wl_export_item(FILE *out, int item, int n)
 {
 	char email[MAX_EMAIL_LEN];
 
-	fprintf(out, "# Wanderlust address book written by %s\n\n", PACKAGE);
-	db_enumerate_items(e) {
-		get_first_email(email, e.item);
-		if(*email) {
-			fprintf(out,
-				"%s\t\"%s\"\t\"%s\"\n",
-				email,
-				safe_str(db_fget(e.item, NICK)),
-				safe_str(db_name_get(e.item))
-			);
-		}
+	get_first_email(email, item);
+	if(*email) {
+		fprintf(out,
+			"%s\t\"%s\"\t\"%s\"\n",
+			email,
+			safe_str(db_fget(item, NICK)),
+			safe_str(db_name_get(item))
+		);
 	}
+}
 
+static void
+wl_export_tail(FILE *out)
+{
 	fprintf (out, "\n# End of address book file.\n");
+}
+
+static int
+wl_export_database(FILE *out, struct db_enumerator e)
+{
+	int n = 0;
+
+	wl_export_head(out);
+
+	db_enumerate_items(e)
+		wl_export_item(out, e.item, n++);
+
+	wl_export_tail(out);
 
 	return 0;
 }
@@ -2534,25 +4094,32 @@ wl_export_database(FILE *out, struct db_enumerator e)
  * BSD calendar export filter
  */
 
+static void
+bsdcal_export_item(FILE *out, int item, int n)
+{
+	int year, month = 0, day = 0;
+	char *anniversary = db_fget(item, ANNIVERSARY);
+
+	if(anniversary) {
+		if(!parse_date_string(anniversary, &day, &month, &year))
+			return;
+
+		fprintf(out,
+			_("%02d/%02d\tAnniversary of %s\n"),
+			month,
+			day,
+			safe_str(db_name_get(item))
+		);
+	}
+}
+
 static int
 bsdcal_export_database(FILE *out, struct db_enumerator e)
 {
-	db_enumerate_items(e) {
-		int year, month = 0, day = 0;
-		char *anniversary = db_fget(e.item, ANNIVERSARY);
-
-		if(anniversary) {
-			if(!parse_date_string(anniversary, &day, &month, &year))
-				continue;
-
-			fprintf(out,
-				_("%02d/%02d\tAnniversary of %s\n"),
-				month,
-				day,
-				safe_str(db_name_get(e.item))
-			);
-		}
-	}
+	int n = 0;
+
+	db_enumerate_items(e)
+		bsdcal_export_item(out, e.item, n++);
 
 	return 0;
 }
@@ -2563,175 +4130,292 @@ bsdcal_export_database(FILE *out, struct db_enumerator e)
 
 /*
  * custom export filter
+ *
+ * The format string is compiled once into an array of operations,
+ * which are run for every item.
  */
 
-static int
-find_field_enum(char *s) {
-	int i = -1;
-	while(standard_fields[++i].key)
-		if(!strcmp(standard_fields[i].key, s))
-			return i;
-	return -1;
+#define CUSTOM_FILTER_FIRST	(1 << 0) /* first entry of a list */
+#define CUSTOM_FILTER_UPPER	(1 << 1)
+#define CUSTOM_FILTER_LOWER	(1 << 2)
+
+enum {
+	CUSTOM_OP_TEXT,		/* literal text */
+	CUSTOM_OP_FIELD,	/* {field|filter...} */
+	CUSTOM_OP_IF,		/* {?field}: skip to the matching {/} if empty */
+	CUSTOM_OP_ENDIF		/* {/} */
+};
+
+struct custom_op {
+	int type;
+	int field;	/* field number, -1 if not in use */
+	int filters;
+	int required;	/* the item is skipped if this field is NULL */
+	size_t text;	/* CUSTOM_OP_TEXT: slice of custom_text */
+	size_t len;
+	int jump;	/* CUSTOM_OP_IF: index of the matching CUSTOM_OP_ENDIF */
+};
+
+static struct custom_op *custom_ops = NULL;
+static int custom_ops_count = 0;
+static char *custom_text = NULL;
+static size_t custom_text_len = 0;
+
+static struct custom_op *
+custom_add_op(int type)
+{
+	struct custom_op *op = &custom_ops[custom_ops_count++];
+
+	memset(op, 0, sizeof(struct custom_op));
+	op->type = type;
+	op->field = -1;
+
+	return op;
 }
 
-/* Convert a string with named placeholders to
-   a *printf() compatible string.
-   Stores the abook field values into ft. */
-void
-parse_custom_format(char *s, char *fmt_string, enum field_types *ft)
+static void
+custom_add_text(char *s, size_t len)
+{
+	struct custom_op *op = custom_ops_count ?
+		&custom_ops[custom_ops_count - 1] : NULL;
+
+	/* custom_text is filled in order: consecutive text is merged */
+	if(!op || op->type != CUSTOM_OP_TEXT) {
+		op = custom_add_op(CUSTOM_OP_TEXT);
+		op->text = custom_text_len;
+	}
+
+	memcpy(custom_text + custom_text_len, s, len);
+	custom_text_len += len;
+	op->len += len;
+}
+
+/* Reads "field|filter|..." into op. */
+static int
+custom_parse_placeholder(char *s, struct custom_op *op)
 {
-	if(! fmt_string || ! ft) {
-	  fprintf(stderr, _("parse_custom_format: fmt_string or ft not allocated\n"));
-	  exit(EXIT_FAILURE);
+	char *filter, *next;
+
+	if((filter = strchr(s, '|')))
+		*filter++ = 0;
+
+	if(!find_field_number(s, &op->field) && !find_standard_field(s, 0)) {
+		fprintf(stderr, _("parse_custom_format: invalid placeholder: {%s}\n"), s);
+		return -1;
+	}
+
+	for(; filter; filter = next) {
+		if((next = strchr(filter, '|')))
+			*next++ = 0;
+
+		if(!strcmp(filter, "first"))
+			op->filters |= CUSTOM_FILTER_FIRST;
+		else if(!strcmp(filter, "upper"))
+			op->filters |= CUSTOM_FILTER_UPPER;
+		else if(!strcmp(filter, "lower"))
+			op->filters |= CUSTOM_FILTER_LOWER;
+		else {
+			fprintf(stderr, _("parse_custom_format: invalid filter: |%s\n"), filter);
+			return -1;
+		}
 	}
 
-	char tmp[1] = { 0 };
-	char *p, *start, *field_name = NULL;
+	return 0;
+}
+
+/* Compiles a string with named placeholders into custom_ops. */
+static void
+parse_custom_format(char *s)
+{
+	struct custom_op *op;
+	char *p, *start, *name;
+	char c;
+	int i, depth = 0, required = 0;
+
+	/* every operation eats at least one character of s */
+	custom_ops = xrealloc(custom_ops, (strlen(s) + 1) * sizeof(struct custom_op));
+	custom_text = xrealloc(custom_text, strlen(s) + 1);
+	custom_ops_count = 0;
+	custom_text_len = 0;
+
 	p = start = s;
 
+	// if the first character is '!': all fields (outside of
+	// conditionals) must exist for the item to be printed
+	if(*p == '!') {
+		required = 1;
+		p++;
+	}
+
 	while(*p) {
 		if(*p == '{') {
-		  start = ++p;
-
-		  if(! *start) goto cannotparse;
-		  p = strchr(start, '}');
-		  if(! p) goto cannotparse;
-		  strcat(fmt_string, "%s");
-		  field_name = strndup(start, (size_t)(p-start));
-		  *ft = find_field_enum(field_name);
-		  if(*ft == -1) {
-		    fprintf(stderr, _("parse_custom_format: invalid placeholder: {%s}\n"), field_name);
-		    exit(EXIT_FAILURE);
-		  }
-
-		  ft++;
-		  start = ++p;
+			start = ++p;
+
+			if(! *start) goto cannotparse;
+			p = strchr(start, '}');
+			if(! p) goto cannotparse;
+			name = xstrndup(start, p - start);
+
+			if(!strcmp(name, "/")) {
+				for(i = custom_ops_count - 1; i >= 0; i--)
+					if(custom_ops[i].type == CUSTOM_OP_IF &&
+							!custom_ops[i].jump)
+						break;
+				if(i < 0) {
+					free(name);
+					goto cannotparse;
+				}
+				custom_ops[i].jump = custom_ops_count;
+				custom_add_op(CUSTOM_OP_ENDIF);
+				depth--;
+			} else if(*name == '?') {
+				op = custom_add_op(CUSTOM_OP_IF);
+				if(custom_parse_placeholder(name + 1, op))
+					exit(EXIT_FAILURE);
+				depth++;
+			} else {
+				op = custom_add_op(CUSTOM_OP_FIELD);
+				if(custom_parse_placeholder(name, op))
+					exit(EXIT_FAILURE);
+				op->required = required && !depth;
+			}
+
+			free(name);
+			start = ++p;
 		}
 
 		else if(*p == '\\') {
 			++p;
-			if(! *p) tmp[0] = '\\'; // last char is a '\' ?
-			else if(*p == 'n') *tmp = '\n';
-			else if(*p == 't') *tmp = '\t';
-			else if(*p == 'r') *tmp = '\r';
-			else if(*p == 'v') *tmp = '\v';
-			else if(*p == 'b') *tmp = '\b';
-			else if(*p == 'a') *tmp = '\a';
-			else *tmp = *p;
-			strncat(fmt_string, tmp, 1);
+			if(! *p) { // last char is a '\' ?
+				custom_add_text("\\", 1);
+				break;
+			}
+			else if(*p == 'n') c = '\n';
+			else if(*p == 't') c = '\t';
+			else if(*p == 'r') c = '\r';
+			else if(*p == 'v') c = '\v';
+			else if(*p == 'b') c = '\b';
+			else if(*p == 'a') c = '\a';
+			else c = *p;
+			custom_add_text(&c, 1);
 			start = ++p;
 		}
 
-		// if no '\' following: quick mode using strchr/strncat
-		else if(! strchr(start, '\\')) {
-		  p = strchr(start, '{');
-		  if(p) { // copy until the next placeholder
-		    strncat(fmt_string, start, (size_t)(p-start));
-		    start = p;
-		  }
-		  else { // copy till the end
-		    strncat( fmt_string,
-			     start,
-			     FORMAT_STRING_LEN - strlen(fmt_string) - 1 );
-		    break;
-		  }
-		}
-
-		// otherwise character by character
 		else {
-			strncat(fmt_string, p, 1);
-			start = ++p;
+			start = p;
+			p += strcspn(p, "{\\");
+			custom_add_text(start, p - start);
 		}
 	}
 
-	*ft = ITEM_FIELDS;
+	if(depth) { // unterminated {?field}
+		start = p;
+		goto cannotparse;
+	}
+
 	return;
 
  cannotparse:
 	fprintf(stderr, _("%s: invalid format, index %ld\n"), __FUNCTION__, (start - s));
-	free(ft);
 	exit(EXIT_FAILURE);
 }
 
-static int
-custom_export_item(FILE *out, int item, char *s, enum field_types *ft);
+static void
+custom_put_value(struct outbuf *b, char *s, size_t len, int filters)
+{
+	if(!(filters & (CUSTOM_FILTER_UPPER | CUSTOM_FILTER_LOWER))) {
+		outbuf_add(b, s, len);
+		return;
+	}
 
+	for(; len; s++, len--)
+		outbuf_putc(b, (filters & CUSTOM_FILTER_UPPER) ?
+				toupper((unsigned char)*s) :
+				tolower((unsigned char)*s));
+}
 
-// stores the format string generated from --outformatstr {custom_format}
-// (when "custom" output format is requested)
-// overrides default value of custom_format set by from abook.c
-extern char custom_format[FORMAT_STRING_LEN];
-char parsed_custom_format[FORMAT_STRING_LEN];
-enum field_types *custom_format_fields = 0;
+/* Renders item followed by a newline, unless it must be skipped. */
+static void
+custom_put_item(struct outbuf *b, int item)
+{
+	struct custom_op *op;
+	char *value, *end;
+	size_t len;
+	int i;
+
+	if(!custom_ops) // --mutt-query doesn't call custom_export_head()
+		parse_custom_format(custom_format);
+
+	for(i = 0; i < custom_ops_count; i++)
+		if(custom_ops[i].required &&
+				!db_fget_byid(item, custom_ops[i].field))
+			return;
+
+	for(i = 0; i < custom_ops_count; i++) {
+		op = &custom_ops[i];
+
+		switch(op->type) {
+			case CUSTOM_OP_TEXT:
+				outbuf_add(b, custom_text + op->text, op->len);
+				break;
+			case CUSTOM_OP_FIELD:
+				if(!(value = db_fget_byid(item, op->field)))
+					break;
+				if((op->filters & CUSTOM_FILTER_FIRST) &&
+						(end = strchr(value, ',')))
+					len = end - value;
+				else
+					len = strlen(value);
+				custom_put_value(b, value, len, op->filters);
+				break;
+			case CUSTOM_OP_IF:
+				value = db_fget_byid(item, op->field);
+				if(!value || !*value)
+					i = op->jump;
+				break;
+		}
+	}
+
+	outbuf_putc(b, '\n');
+}
 
-/* wrapper for custom_export_item:
-   1) avoid messing with extern pointer
-   2) adds \n
-   3) follow the prototype needed for an abook_output_item_filter entry */
+/* follows the prototype needed for an abook_output_item_filter entry */
 void
 custom_print_item(FILE *out, int item)
 {
+	struct outbuf b;
+	char space[BUFSIZ];
 
-  if(custom_export_item(out, item, parsed_custom_format, custom_format_fields) == 0)
-    fprintf(out, "\n");
+	outbuf_init(&b, out, space, sizeof(space));
+	custom_put_item(&b, item);
+	outbuf_flush(&b);
 }
 
-static int
-custom_export_item(FILE *out, int item, char *fmt, enum field_types *ft)
-{
-  char *p, *q = 0;
-
-  // if the first character is '!':
-  // we first check that all fields exist before continuing
-  if(*fmt == '!') {
-    enum field_types *ftp = ft;
-    while(*ft != ITEM_FIELDS) {
-      if(! db_fget(item, *ft) )
-	return 1;
-      ft++;
-    }
-    ft = ftp;
-    fmt++;
-  }
-
-  while (*fmt) {
-    if(!strncmp(fmt, "%s", 2)) {
-      fprintf(out, "%s", safe_str(db_fget(item, *ft)));
-      ft++;
-      fmt+=2;
-    } else if (*ft == ITEM_FIELDS) {
-      fprintf(out, "%s", fmt);
-      return 0;
-    } else {
-      p = strchr(fmt, '%');
-      if(*p) {
-	q = strndup(fmt, (size_t)(p-fmt));
-	fprintf(out, "%s", q);
-	free(q);
-	fmt = p;
-      }
-      else {
-	fprintf(out, "%s", fmt);
-	return 0;
-      }
-    }
-  }
+static void
+custom_export_head(FILE *out)
+{
+	parse_custom_format(custom_format);
+}
 
-  return 0;
+static void
+custom_stream_item(FILE *out, int item, int n)
+{
+	custom_print_item(out, item);
 }
 
 static int
 custom_export_database(FILE *out, struct db_enumerator e)
 {
-	enum field_types *ft =
-	  (enum field_types *)malloc(FORMAT_STRING_MAX_FIELDS * sizeof(enum field_types));
-
-	parse_custom_format(custom_format, (char*)&parsed_custom_format, ft);
-	db_enumerate_items(e) {
-	  if(custom_export_item(out, e.item, (char*)&parsed_custom_format, ft) == 0)
-	    fprintf(out, "\n");
-	}
-	return 0;
+	struct outbuf b;
+	int ret;
+
+	custom_export_head(out);
+	outbuf_init(&b, out, NULL, OUTBUF_BLOCK);
+	db_enumerate_items(e)
+	  custom_put_item(&b, e.item);
+	ret = outbuf_flush(&b);
+	outbuf_free(&b);
+	return ret;
 }
 
 /*
@@ -2,10 +2,10 @@
 #define _FILTER_H
 
 #include "database.h"
+#include "misc.h"
 
 #define		FILTNAME_LEN	8
 #define		FORMAT_STRING_LEN	512
-#define		FORMAT_STRING_MAX_FIELDS	16
 
 
 struct abook_output_filter {
@@ -20,6 +20,14 @@ struct abook_output_item_filter {
 	void (*func) (FILE *handle, int item);
 };
 
+/* n is the position of the item in the output */
+struct abook_output_stream_filter {
+	char filtname[FILTNAME_LEN];
+	void (*head) (FILE *handle);
+	void (*item) (FILE *handle, int item, int n);
+	void (*tail) (FILE *handle);
+};
+
 struct abook_input_filter {
 	char filtname[FILTNAME_LEN];
 	char *desc;
@@ -29,9 +37,15 @@ struct abook_input_filter {
 
 int		import_database();
 int             import_file(char filtname[FILTNAME_LEN], char *filename);
+int		import_files(char filtname[FILTNAME_LEN], abook_list *files);
 
 int		export_database();
-int             export_file(char filtname[FILTNAME_LEN], char *filename);
+int             export_file(char filtname[FILTNAME_LEN], char *filename,
+			int mode);
+
+int		convert_stream(char srcformat[FILTNAME_LEN], char *srcfile,
+		char dstformat[FILTNAME_LEN], char *dstfile);
+void		export_cache_source(char *filename);
 
 struct abook_output_item_filter
 		select_output_item_filter(char filtname[FILTNAME_LEN]);
@@ -39,7 +53,6 @@ struct abook_output_item_filter
 void		e_write_item(FILE *out, int item, void (*func) (FILE *in, int item));
 void		muttq_print_item(FILE *file, int item);
 
-void		parse_custom_format(char *s, char *fmt_string, enum field_types *ft);
 void		custom_print_item(FILE *out, int item);
 
 int		fexport(char filtname[FILTNAME_LEN], FILE *handle,
@@ -21,6 +21,8 @@ N_("	r / del		remove selected items\n"),
 N_("	M		merge selected items (into top one)\n"),
 N_("	D		duplicate item\n"),
 N_("	U		remove duplicates\n"),
+N_("	u		undo\n"),
+N_("	^R		redo\n"),
 "\n",
 N_("	space		select item\n"),
 N_("	+		select all\n"),
@@ -41,6 +43,7 @@ N_("	F		sort by field (defined in configuration file)\n"),
 "\n",
 N_("	/		search\n"),
 N_("	\\		search next occurrence\n"),
+N_("	L		limit the list to matching items\n"),
 "\n",
 N_("	A		move current item up\n"),
 N_("	Z		move current item down\n"),
@@ -67,6 +70,7 @@ N_("	r			roll e-mail addresses up\n"),
 N_("	ESC-r			roll e-mail addresses down\n"),
 "\n",
 N_("	u			undo\n"),
+N_("	^R			redo\n"),
 "\n",
 N_("	m			send mail with mutt\n"),
 N_("	v			view url with web browser\n"),
@@ -23,7 +23,11 @@
 #include <ctype.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
 #include "ldif.h"
+#include "misc.h"
 
 #define ISSPACE(c) isspace((unsigned char)c)
 
@@ -344,3 +348,92 @@ ldif_type_and_value(char *type, char *val, int vlen)
 
 	return (buf);
 }
+
+/*
+ * Writes the same line as put_type_and_value(), straight into b
+ */
+
+static int
+ldif_needs_base64(const unsigned char *p, int len)
+{
+	const unsigned char *stop = p + len;
+
+	if(len && (*p == ' ' || *p == ':'))
+		return 1;
+
+	for(; p < stop; p++)
+		if(*p < 0x20 || *p > 0x7e) /* !isascii() || !isprint() */
+			return 1;
+
+	return 0;
+}
+
+/* col is the length of the current line */
+static void
+ldif_put_folded(struct outbuf *b, const char *s, int len, int *col)
+{
+	int n;
+
+	while(len > 0) {
+		if(*col > LDIF_LINE_WIDTH) {
+			outbuf_literal(b, "\n ");
+			*col = 1;
+		}
+		n = LDIF_LINE_WIDTH + 1 - *col;
+		if(n > len)
+			n = len;
+		outbuf_add(b, s, n);
+		s += n;
+		len -= n;
+		*col += n;
+	}
+}
+
+void
+ldif_put_type_and_value(struct outbuf *b, const char *t, int tlen,
+		const char *val, int vlen)
+{
+	const unsigned char *byte = (const unsigned char *) val;
+	const unsigned char *stop = byte + vlen;
+	char digits[LDIF_LINE_WIDTH + 4];
+	unsigned long bits;
+	int i, n = 0, col = tlen + 1;
+
+	outbuf_add(b, t, tlen);
+
+	if(!ldif_needs_base64(byte, vlen)) {
+		outbuf_literal(b, ": ");
+		ldif_put_folded(b, val, vlen, &col);
+		outbuf_putc(b, '\n');
+		return;
+	}
+
+	outbuf_literal(b, ":: ");
+	col += 2;
+
+	/* convert to base 64 (3 bytes => 4 base 64 digits) */
+	for(; byte < stop; byte += 3) {
+		bits = (byte[0] & 0xff) << 16;
+		if(byte + 1 < stop)
+			bits |= (byte[1] & 0xff) << 8;
+		if(byte + 2 < stop)
+			bits |= (byte[2] & 0xff);
+
+		for(i = 0; i < 4; i++, bits <<= 6)
+			digits[n++] = nib2b64[(bits & 0xfc0000L) >> 18];
+
+		/* padding */
+		if(byte + 2 >= stop)
+			digits[n - 1] = '=';
+		if(byte + 1 >= stop)
+			digits[n - 2] = '=';
+
+		if(n >= LDIF_LINE_WIDTH) {
+			ldif_put_folded(b, digits, n, &col);
+			n = 0;
+		}
+	}
+
+	ldif_put_folded(b, digits, n, &col);
+	outbuf_putc(b, '\n');
+}
@@ -12,5 +12,9 @@ char		*str_getline( char **next );
 void		put_type_and_value( char **out, char *t, char *val, int vlen );
 char		*ldif_type_and_value( char *type, char *val, int vlen );
 
+struct outbuf;
+void		ldif_put_type_and_value(struct outbuf *b, const char *t,
+		int tlen, const char *val, int vlen);
+
 
 #endif
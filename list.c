@@ -23,13 +23,58 @@
 int curitem = -1;
 int first_list_item = -1;
 int scroll_speed = 2;
-char *selected = NULL;
 
 extern abook_field_list *fields_list;
 struct index_elem *index_elements = NULL;
 
 static WINDOW *list = NULL;
 
+/*
+ * The rows of the list as print_list_line() draws them, valid for the
+ * width of the screen and the state of the database given by db_changes()
+ */
+struct list_cell {
+	int x;
+	int len;	/* -1 for the whole text */
+	char *text;
+	long off;	/* of the text in the row, -1 for index text */
+};
+
+struct list_row {
+	unsigned int changes;
+	int cols;
+	int n_cells;
+	struct list_cell *cells; /* followed by the text of the fields */
+};
+
+static struct list_row *list_rows = NULL;
+static int list_rows_count = 0;
+static int list_cells_max = 0;
+
+/*
+ * What the list window shows, so that refresh_list() only needs to
+ * repaint the lines that changed
+ */
+static struct {
+	int valid;
+	int first, cur, items;
+	unsigned int changes;
+	char *selected;		/* of each line */
+} drawn;
+
+/*
+ * The limit: while limit_items is set the list shows only those items and
+ * curitem and first_list_item are positions in it rather than items
+ */
+static char *limit_str = NULL;
+static int *limit_fields;
+static int *limit_items = NULL;
+static int limit_n = 0;
+static int limit_owned = FALSE;	/* limit_items is ours, and kept current */
+static unsigned int limit_changes;
+
+#define LIST_ITEM(pos)	(limit_items ? limit_items[pos] : (pos))
+
 
 static void
 index_elem_add(int type, char *a, char *b)
@@ -120,8 +165,16 @@ parse_index_format(char *s)
 void
 init_index()
 {
+	/* the parser cuts the string, which other users still need */
+	char *s = xstrdup(opt_get_str(STR_INDEX_FORMAT));
+	struct index_elem *e;
+
 	assert(!index_elements);
-	parse_index_format(opt_get_str(STR_INDEX_FORMAT));
+	parse_index_format(s);
+	free(s);
+
+	for(e = index_elements; e; e = e->next)
+		list_cells_max++;
 }
 
 void
@@ -129,7 +182,25 @@ init_list()
 {
 	list = newwin(LIST_LINES, LIST_COLS, LIST_TOP, 0);
 	scrollok(list, TRUE);
+	idlok(list, TRUE);
 	scroll_speed = abs(opt_get_int(INT_SCROLL_SPEED));
+
+	drawn.valid = FALSE;
+	drawn.selected = xmalloc(max(LIST_LINES, 1));
+
+	db_set_shown(list_item_shown);
+}
+
+static void
+free_list_n_rows()
+{
+	int i;
+
+	for(i = 0; i < list_rows_count; i++)
+		xfree(list_rows[i].cells);
+
+	xfree(list_rows);
+	list_rows_count = 0;
 }
 
 void
@@ -137,6 +208,138 @@ close_list()
 {
 	delwin(list);
 	list = NULL;
+	db_set_shown(NULL);
+	free_list_n_rows();
+	xfree(drawn.selected);
+}
+
+static void
+limit_set_items(int *items, int n, int owned)
+{
+	int item = list_get_curitem();
+
+	if(limit_owned)
+		xfree(limit_items);
+
+	limit_items = items;
+	limit_n = n;
+	limit_owned = owned;
+	limit_changes = db_changes();
+	drawn.valid = FALSE;
+
+	list_set_curitem(item);
+}
+
+/* matches the limit again after the database changed */
+static void
+limit_update()
+{
+	if(!limit_owned || limit_changes == db_changes())
+		return;
+
+	limit_n = find_items(limit_str, limit_fields, limit_items =
+		xrealloc(limit_items, sizeof(int) * max(db_n_items(), 1)));
+	limit_changes = db_changes();
+
+	if(curitem >= limit_n)
+		curitem = limit_n - 1;
+}
+
+/* number of the rows in the list */
+static int
+list_n_rows()
+{
+	limit_update();
+
+	return limit_items ? limit_n : db_n_items();
+}
+
+/* shows only the items matching str, or all of them if str is empty */
+void
+list_limit(char *str, int search_fields[])
+{
+	int *items;
+
+	xfree(limit_str);
+
+	if(!str || !*str) {
+		limit_set_items(NULL, 0, FALSE);
+		return;
+	}
+
+	limit_str = xstrdup(str);
+	limit_fields = search_fields;
+	items = xmalloc(sizeof(int) * max(db_n_items(), 1));
+	limit_set_items(items, find_items(str, search_fields, items), TRUE);
+}
+
+/*
+ * shows only items[0..n-1] until the next list_limit(), items is copied:
+ * the incremental search frees its arrays while the line is edited
+ */
+void
+list_limit_preview(int *items, int n)
+{
+	int *copy;
+
+	if(!items) {
+		if(limit_items)
+			limit_set_items(NULL, 0, FALSE);
+		return;
+	}
+
+	if(limit_items && n == limit_n &&
+			!memcmp(items, limit_items, sizeof(int) * n))
+		return;
+
+	copy = xmalloc(sizeof(int) * max(n, 1));
+	memcpy(copy, items, sizeof(int) * n);
+	limit_set_items(copy, n, TRUE);
+}
+
+char *
+list_get_limit()
+{
+	return limit_str;
+}
+
+int
+list_item_shown(int item)
+{
+	int lo, hi, mid;
+
+	if(list_n_rows() == db_n_items())
+		return TRUE;
+
+	for(lo = 0, hi = limit_n; lo < hi; ) {
+		mid = (lo + hi) / 2;
+		if(limit_items[mid] < item)
+			lo = mid + 1;
+		else if(limit_items[mid] > item)
+			hi = mid;
+		else
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/* number of the items shown */
+int
+list_shown_items()
+{
+	return list_n_rows();
+}
+
+int
+list_item_at(int pos)
+{
+	int n = list_n_rows();
+
+	if(pos >= n)
+		pos = n - 1;
+
+	return (pos < 0) ? -1 : LIST_ITEM(pos);
 }
 
 void
@@ -157,11 +360,13 @@ get_list_field(int item, struct index_elem *e, struct list_field *res)
 	get_field_info(e->d.field.id, NULL, NULL, &res->type);
 }
 
-static void
-print_list_field(int item, int line, int *x_pos, struct index_elem *e)
+/* fills in c for field e, the text going to b; returns the cells used */
+static int
+list_field_cell(int item, int *x_pos, struct index_elem *e,
+		struct list_cell *c, struct outbuf *b)
 {
 	char *s, *p;
-	int width, x_start, mustfree = FALSE, len = abs(e->d.field.len);
+	int width, x_start, n = 0, mustfree = FALSE, len = abs(e->d.field.len);
 	struct list_field f;
 
 	get_list_field(item, e, &f);
@@ -169,7 +374,7 @@ print_list_field(int item, int line, int *x_pos, struct index_elem *e)
 
 	if(!s || !*s) {
 		*x_pos += len;
-		return;
+		return 0;
 	}
 
 	if(f.type == FIELD_EMAILS && !opt_get_bool(BOOL_SHOW_ALL_EMAILS))
@@ -183,13 +388,89 @@ print_list_field(int item, int line, int *x_pos, struct index_elem *e)
 	if(width + x_start >= COLS)
 		width = bytes2width(s, COLS - x_start);
 
-	if(width)
-		mvwaddnstr(list, line, x_start, s, width);
+	if(width) {
+		c->x = x_start;
+		c->len = (width < 0) ? -1 : min(width, (int)strlen(s));
+		c->off = b->len;
+		outbuf_add(b, s, (c->len < 0) ? strlen(s) : c->len);
+		outbuf_putc(b, 0);
+		n++;
+	}
 
 	if(mustfree)
 		free(s);
 
 	*x_pos += len ? len : width;
+
+	return n;
+}
+
+static void
+list_row_build(struct list_row *r, int item)
+{
+	struct index_elem *cur;
+	struct list_cell *c;
+	struct outbuf b;
+	char space[BUFSIZ];
+	size_t size = sizeof(struct list_cell) * max(list_cells_max, 1);
+	int i, n = 0, x_pos = 1;
+
+	xfree(r->cells);
+	r->cells = xmalloc(size);
+
+	outbuf_init(&b, NULL, space, sizeof(space));
+
+	for(cur = index_elements; cur; cur = cur->next) {
+		c = &r->cells[n];
+		switch(cur->type) {
+			case INDEX_TEXT:
+				c->x = x_pos;
+				c->len = -1;
+				c->text = cur->d.text;
+				c->off = -1;
+				x_pos += strwidth(cur->d.text);
+				n++;
+				break;
+			case INDEX_FIELD:
+				n += list_field_cell(item, &x_pos, cur, c, &b);
+				break;
+			default:
+				assert(0);
+		}
+	}
+
+	/* the text of the fields follows the cells */
+	r->cells = xrealloc(r->cells, size + b.len);
+	memcpy((char *)r->cells + size, b.data, b.len);
+	for(i = 0, c = r->cells; i < n; i++, c++)
+		if(c->off >= 0)
+			c->text = (char *)r->cells + size + c->off;
+	outbuf_free(&b);
+
+	r->n_cells = n;
+	r->changes = db_changes();
+	r->cols = COLS;
+}
+
+static struct list_row *
+list_row_get(int item)
+{
+	struct list_row *r;
+	int n;
+
+	if(item >= list_rows_count) {
+		n = max(item + 1, list_rows_count * 2);
+		list_rows = xrealloc(list_rows, sizeof(struct list_row) * n);
+		memset(&list_rows[list_rows_count], 0,
+				sizeof(struct list_row) * (n - list_rows_count));
+		list_rows_count = n;
+	}
+
+	r = &list_rows[item];
+	if(!r->cells || r->changes != db_changes() || r->cols != COLS)
+		list_row_build(r, item);
+
+	return r;
 }
 
 static void
@@ -223,55 +504,64 @@ highlight_line(WINDOW *win, int line)
 }
 
 static void
-print_list_line(int item, int line, int highlight)
+print_list_line(int pos, int line, int highlight)
 {
-	struct index_elem *cur;
-	int x_pos = 1;
+	int item = LIST_ITEM(pos);
+	struct list_row *r = list_row_get(item);
+	struct list_cell *c;
+	int i;
 
-	if(item % 2 == 0)
+	if(pos % 2 == 0)
 		wattrset(list, COLOR_PAIR(CP_LIST_EVEN));
 	else
 		wattrset(list, COLOR_PAIR(CP_LIST_ODD));
-	scrollok(list, FALSE);
 	if(highlight)
 		highlight_line(list, line);
+	/* the last line must not scroll the window */
+	scrollok(list, FALSE);
 
-	if(selected[item])
+	if(is_selected(item))
 		mvwaddch(list, line, 0, '*' );
 
-	for(cur = index_elements; cur; cur = cur->next)
-		switch(cur->type) {
-			case INDEX_TEXT:
-				mvwaddstr(list, line, x_pos, cur->d.text);
-				x_pos += strwidth(cur->d.text);
-				break;
-			case INDEX_FIELD:
-				print_list_field(item, line, &x_pos, cur);
-				break;
-			default:
-				assert(0);
-		}
+	for(i = 0, c = r->cells; i < r->n_cells; i++, c++)
+		mvwaddnstr(list, line, c->x, c->text, c->len);
 
 	scrollok(list, TRUE);
 	if(highlight)
 		wstandend(list);
 }
 
+/* tells whether the line showing the row pos needs to be repainted */
+static int
+list_line_changed(int pos, int line)
+{
+	int old = pos - drawn.first;
+
+	if(old < 0 || old >= LIST_LINES)
+		return TRUE;
+
+	return pos == curitem || pos == drawn.cur ||
+		drawn.selected[old] != is_selected(LIST_ITEM(pos));
+}
+
 void
 refresh_list()
 {
-	int i, line;
-
-	werase(list);
+	int i, line, full, delta, n = list_n_rows();
 
 	ui_print_number_of_items();
 
-	if(list_is_empty()) {
+	if(!n) {
+		werase(list);
+		drawn.valid = FALSE;
 		refresh();
 		wrefresh(list);
 		return;
 	}
 
+	if(curitem >= n)
+		curitem = n - 1;
+
 	if(curitem < 0)
 		curitem = 0;
 
@@ -283,19 +573,44 @@ refresh_list()
 	else if(curitem > LAST_LIST_ITEM)
 		first_list_item = max(curitem - LIST_LINES + 1, 0);
 
-        for(line = 0, i = first_list_item;
-			i <= LAST_LIST_ITEM && i < db_n_items();
+	delta = first_list_item - drawn.first;
+	full = !drawn.valid || drawn.changes != db_changes() ||
+		drawn.items != n || abs(delta) >= LIST_LINES;
+
+	if(full)
+		werase(list);
+	else if(delta)
+		wscrl(list, delta);
+
+	for(line = 0, i = first_list_item;
+			i <= LAST_LIST_ITEM && i < n;
 			line++, i++) {
+		if(!full && !list_line_changed(i, line))
+			continue;
 
+		if(!full) {
+			wmove(list, line, 0);
+			wclrtoeol(list);
+		}
 		print_list_line(i, line, i == curitem);
-        }
+	}
+
+	for(line = 0, i = first_list_item; line < LIST_LINES; line++, i++)
+		drawn.selected[line] = (i < n) ? is_selected(LIST_ITEM(i)) : 0;
+	drawn.first = first_list_item;
+	drawn.cur = curitem;
+	drawn.items = n;
+	drawn.changes = db_changes();
+	drawn.valid = TRUE;
 
 	if(opt_get_bool(BOOL_SHOW_CURSOR)) {
 		wmove(list, curitem - first_list_item, 0);
 		/* need to call refresh() to update the cursor positions */
 		refresh();
 	}
-        wrefresh(list);
+	/* other windows may have been drawn over the list */
+	touchwin(list);
+	wrefresh(list);
 }
 
 void
@@ -344,7 +659,7 @@ scroll_up()
 void
 scroll_down()
 {
-	if(curitem > db_n_items() - 2)
+	if(curitem > list_n_rows() - 2)
 		return;
 
 	curitem++;
@@ -377,7 +692,7 @@ scroll_list_up()
 void
 scroll_list_down()
 {
-	if(LAST_LIST_ITEM > db_n_items() - 2) {
+	if(LAST_LIST_ITEM > list_n_rows() - 2) {
 		if(curitem < LAST_LIST_ITEM) {
 			curitem++;
 			refresh_list();
@@ -386,8 +701,8 @@ scroll_list_down()
 	}
 
 	first_list_item += scroll_speed;
-	if(LAST_LIST_ITEM > db_n_items() - 1) {
-		first_list_item = db_n_items() - LIST_LINES;
+	if(LAST_LIST_ITEM > list_n_rows() - 1) {
+		first_list_item = list_n_rows() - LIST_LINES;
 	}
 	if(curitem < first_list_item) {
 		curitem = first_list_item;
@@ -411,14 +726,16 @@ page_up()
 void
 page_down()
 {
-	if(curitem > db_n_items() - 2)
+	int last = list_n_rows() - 1;
+
+	if(curitem > last - 1)
 		return;
 
 	if(curitem == LAST_LIST_ITEM) {
-		if((curitem += LIST_LINES) > last_item())
-			curitem = last_item();
+		if((curitem += LIST_LINES) > last)
+			curitem = last;
 	} else {
-		curitem = min(LAST_LIST_ITEM, last_item());
+		curitem = min(LAST_LIST_ITEM, last);
 	}
 
 	refresh_list();
@@ -427,13 +744,21 @@ page_down()
 void
 select_none()
 {
-        memset(selected, 0, db_n_items());
+	db_select_all(FALSE);
 }
 
 void
 select_all()
 {
-        memset(selected, 1, db_n_items());
+	int i, n = list_n_rows();
+
+	if(!limit_items) {
+		db_select_all(TRUE);
+		return;
+	}
+
+	for(i = 0; i < n; i++)
+		db_select_item(limit_items[i], TRUE);
 }
 
 void
@@ -441,56 +766,48 @@ list_set_selection(int item, int value)
 {
 	assert(is_valid_item(item));
 
-	selected[item] = !!value;
+	db_select_item(item, value);
 }
 
 void
 list_invert_curitem_selection()
 {
-	assert(is_valid_item(curitem));
+	int item = list_get_curitem();
+
+	assert(is_valid_item(item));
 
-	selected[curitem] = !selected[curitem];
+	db_select_item(item, !is_selected(item));
 }
 
 void
 move_curitem(int direction)
 {
-        list_item tmp;
+	int item = list_get_curitem();
 
-        if(curitem < 0 || curitem > last_item())
+        if(item < 0)
                 return;
 
-	tmp = item_create();
-	item_copy(tmp, db_item_get(curitem));
-
 	switch(direction) {
 		case MOVE_ITEM_UP:
 			if( curitem < 1 )
-				goto out_move;
-			item_copy(db_item_get(curitem),
-					db_item_get(curitem - 1));
-			item_copy(db_item_get(curitem-1), tmp);
+				return;
+			db_swap_items(item, LIST_ITEM(curitem - 1));
 			scroll_up();
 			break;
 
 		case MOVE_ITEM_DOWN:
-			if(curitem >= last_item())
-				goto out_move;
-			item_copy(db_item_get(curitem),
-					db_item_get(curitem + 1));
-			item_copy(db_item_get(curitem + 1), tmp);
+			if(curitem >= list_n_rows() - 1)
+				return;
+			db_swap_items(item, LIST_ITEM(curitem + 1));
 			scroll_down();
 			break;
 	}
-
-out_move:
-	item_free(&tmp);
 }
 
 void
 goto_home()
 {
-	if(db_n_items() > 0)
+	if(list_n_rows() > 0)
 		curitem = 0;
 
 	refresh_list();
@@ -499,8 +816,8 @@ goto_home()
 void
 goto_end()
 {
-	if(db_n_items() > 0)
-		curitem = last_item();
+	if(list_n_rows() > 0)
+		curitem = list_n_rows() - 1;
 
 	refresh_list();
 }
@@ -508,25 +825,24 @@ goto_end()
 int
 selected_items()
 {
-	int i, n = 0;
-
-	for(i = 0; i < db_n_items(); i++)
-		if(selected[i])
-			n++;
-
-	return n;
+	return db_selected_count();
 }
 
 void
 invert_selection()
 {
-	int i;
+	int i, n = list_n_rows();
 
 	if(list_is_empty())
 		return;
 
-	for(i = 0; i < db_n_items(); i++)
-		selected[i] = !selected[i];
+	if(!limit_items) {
+		db_invert_selection();
+		return;
+	}
+
+	for(i = 0; i < n; i++)
+		db_select_item(LIST_ITEM(i), !is_selected(LIST_ITEM(i)));
 }
 
 int
@@ -538,7 +854,11 @@ list_is_empty()
 int
 list_get_curitem()
 {
-	return curitem;
+	if(!limit_items)
+		return curitem;
+
+	return (curitem >= 0 && curitem < list_n_rows()) ?
+		limit_items[curitem] : -1;
 }
 
 int
@@ -547,10 +867,26 @@ list_get_firstitem()
 	return first_list_item;
 }
 
+/* moves to item, or to the next item shown if the limit hides it */
 void
 list_set_curitem(int i)
 {
-	curitem = i;
+	int lo, hi, mid;
+
+	if(!limit_items) {
+		curitem = i;
+		return;
+	}
+
+	for(lo = 0, hi = list_n_rows(); lo < hi; ) {
+		mid = (lo + hi) / 2;
+		if(limit_items[mid] < i)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	curitem = min(lo, limit_n - 1);
 }
 
 int
@@ -558,18 +894,18 @@ duplicate_item()
 {
 	list_item item;
 
-	if(curitem < 0)
+	if(list_get_curitem() < 0)
 		return 1;
 
 	item = item_create();
-	item_duplicate(item, db_item_get(curitem));
+	item_duplicate(item, db_item_get(list_get_curitem()));
 	if(add_item2database(item)) {
 		item_free(&item);
 		return 1;
 	}
 	item_free(&item);
 
-	curitem = last_item();
+	list_set_curitem(last_item());
 	refresh_list();
 
 	return 0;
@@ -51,6 +51,12 @@ int		list_is_empty();
 int		list_get_curitem();
 int		list_get_firstitem();
 void		list_set_curitem(int i);
+void		list_limit(char *str, int search_fields[]);
+void		list_limit_preview(int *items, int n);
+char		*list_get_limit();
+int		list_item_shown(int item);
+int		list_shown_items();
+int		list_item_at(int pos);
 int		duplicate_item();
 
 
@@ -302,20 +302,312 @@ getaline(FILE *f)
 	return buf;
 }
 
+/*
+ * line reader
+ *
+ * Same lines and end of file semantics as getaline(), without an
+ * allocation per line.
+ */
+
+#define LINE_READER_BLOCK	(64 * 1024)
+
+void
+line_reader_init(struct line_reader *r, FILE *f)
+{
+	memset(r, 0, sizeof(struct line_reader));
+	r->f = f;
+	r->size = LINE_READER_BLOCK;
+	r->buf = xmalloc(r->size);
+}
+
+char *
+line_reader_read(struct line_reader *r)
+{
+	char *line, *nl;
+	size_t n;
+
+	r->last_pos = r->pos;
+	r->last_eof = r->eof;
+	r->last_nl = 0;
+
+	for(;;) {
+		if(r->scanned < r->end && (nl = memchr(r->buf + r->scanned,
+					'\n', r->end - r->scanned))) {
+			*nl = '\0';
+			line = r->buf + r->pos;
+			r->pos = r->scanned = nl - r->buf + 1;
+			r->last_nl = 1;
+			return line;
+		}
+		r->scanned = r->end;
+
+		if(r->f_eof) {
+			r->eof = 1;
+			if(r->pos == r->end)
+				return NULL;
+			/* last line, without a newline */
+			line = r->buf + r->pos;
+			r->buf[r->end] = '\0';
+			r->pos = r->end;
+			return line;
+		}
+
+		/* make room for another block */
+		if(r->pos) {
+			memmove(r->buf, r->buf + r->pos, r->end - r->pos);
+			r->base += r->pos;
+			r->end -= r->pos;
+			r->scanned -= r->pos;
+			r->last_pos = r->pos = 0;
+		}
+		if(r->size - r->end < LINE_READER_BLOCK / 2) {
+			r->size *= 2;
+			r->buf = xrealloc(r->buf, r->size);
+		}
+
+		/* keep a byte for the terminating '\0' */
+		n = fread(r->buf + r->end, 1, r->size - r->end - 1, r->f);
+		if(!n)
+			r->f_eof = 1;
+		r->end += n;
+	}
+}
+
+/* makes the last line read be returned again by the next read */
+void
+line_reader_unread(struct line_reader *r)
+{
+	if(r->last_nl)
+		r->buf[r->pos - 1] = '\n';
+	r->pos = r->scanned = r->last_pos;
+	r->eof = r->last_eof;
+}
+
+void
+line_reader_free(struct line_reader *r)
+{
+	xfree(r->buf);
+}
+
+/*
+ * Uses space as the initial storage, or allocates size bytes
+ * if space is NULL.
+ */
+void
+outbuf_init(struct outbuf *b, FILE *f, char *space, size_t size)
+{
+	assert(size > 0);
+
+	b->f = f;
+	b->len = 0;
+	b->size = size;
+	b->err = 0;
+	b->written = 0;
+
+	if((b->own = !space))
+		b->data = xmalloc(size);
+	else
+		b->data = space;
+}
+
+static void
+outbuf_grow(struct outbuf *b, size_t len)
+{
+	size_t size = b->size;
+	char *p;
+
+	while(size < b->len + len)
+		size *= 2;
+
+	if(b->own)
+		b->data = xrealloc(b->data, size);
+	else {
+		p = xmalloc(size);
+		memcpy(p, b->data, b->len);
+		b->data = p;
+		b->own = 1;
+	}
+
+	b->size = size;
+}
+
+static void
+outbuf_write(struct outbuf *b, const char *s, size_t len)
+{
+	if(fwrite(s, 1, len, b->f) != len)
+		b->err = 1;
+	b->written += len;
+}
+
+void
+outbuf_add(struct outbuf *b, const char *s, size_t len)
+{
+	if(b->len + len > b->size) {
+		if(!b->f)
+			outbuf_grow(b, len);
+		else {
+			outbuf_flush(b);
+			if(len > b->size) {
+				outbuf_write(b, s, len);
+				return;
+			}
+		}
+	}
+
+	memcpy(b->data + b->len, s, len);
+	b->len += len;
+}
+
+void
+outbuf_puts(struct outbuf *b, const char *s)
+{
+	outbuf_add(b, s, strlen(s));
+}
+
+void
+outbuf_putc(struct outbuf *b, int c)
+{
+	char ch = c;
+
+	if(b->len < b->size)
+		b->data[b->len++] = ch;
+	else
+		outbuf_add(b, &ch, 1);
+}
+
+/* escape() returns what to write instead of c, or NULL to keep it */
+void
+outbuf_escaped(struct outbuf *b, const char *s, size_t len,
+		const char *(*escape)(int c))
+{
+	const char *start, *rep, *end = s + len;
+
+	for(start = s; s < end; s++)
+		if((rep = (*escape)((unsigned char)*s))) {
+			outbuf_add(b, start, s - start);
+			outbuf_puts(b, rep);
+			start = s + 1;
+		}
+
+	outbuf_add(b, start, s - start);
+}
+
+void
+outbuf_int(struct outbuf *b, int n)
+{
+	char tmp[3 * sizeof(int) + 1];
+	char *p = tmp + sizeof(tmp);
+	unsigned int u = (n < 0) ? -(unsigned int)n : (unsigned int)n;
+
+	do
+		*--p = '0' + u % 10;
+	while(u /= 10);
+
+	if(n < 0)
+		*--p = '-';
+
+	outbuf_add(b, p, tmp + sizeof(tmp) - p);
+}
+
+/* returns -1 if anything could not be written so far */
+int
+outbuf_flush(struct outbuf *b)
+{
+	if(b->f && b->len) {
+		outbuf_write(b, b->data, b->len);
+		b->len = 0;
+	}
+
+	return b->err ? -1 : 0;
+}
+
+void
+outbuf_free(struct outbuf *b)
+{
+	if(b->own)
+		xfree(b->data);
+}
+
+#define HASH_MIX(h, w) \
+	((h) = ((h) ^ (w)) * 0x9e3779b97f4a7c15ULL, (h) ^= (h) >> 32)
+
+unsigned long long
+hash_add(unsigned long long h, const void *p, size_t len)
+{
+	const unsigned char *s = p;
+	unsigned long long w;
+
+	for(; len >= sizeof(w); s += sizeof(w), len -= sizeof(w)) {
+		memcpy(&w, s, sizeof(w));
+		HASH_MIX(h, w);
+	}
+
+	/* the length goes in the last word, "ab" and "ab\0" differ */
+	for(w = len; len--; )
+		w = (w << 8) | s[len];
+	HASH_MIX(h, w);
+
+	return h;
+}
+
+#define BYTES_ONES	((unsigned long)-1 / 0xff)
+#define BYTES_HIGH	(BYTES_ONES * 0x80)
+/* tells whether any byte of w is below n, n being at most 0x80 */
+#define BYTES_LESS(w, n)	(((w) - BYTES_ONES * (n)) & ~(w) & BYTES_HIGH)
+
+/*
+ * tells whether s holds only printable ASCII, which takes a column a byte
+ * in every locale; tests a word at a time as most field values are such
+ */
+static int
+is_printable_ascii(const char *s, size_t len)
+{
+	unsigned long w;
+
+	for(; len >= sizeof(w); s += sizeof(w), len -= sizeof(w)) {
+		memcpy(&w, s, sizeof(w));
+		if((w & BYTES_HIGH) || BYTES_LESS(w, ' ') ||
+				BYTES_LESS(w ^ (BYTES_ONES * 0x7f), 1))
+			return 0;
+	}
+
+	for(; len; s++, len--)
+		if((unsigned char)*s < ' ' || (unsigned char)*s >= 0x7f)
+			return 0;
+
+	return 1;
+}
+
 int
 strwidth(const char *s)
 {
+	size_t len;
+
 	assert(s);
+
+	len = strlen(s);
+	if(is_printable_ascii(s, len))
+		return len;
+
 	return mbswidth(s, 0);
 }
 
 int
 bytes2width(const char *s, int width)
 {
-	assert(s);
 #ifdef HANDLE_MULTIBYTE
-	return mbsnbytes(s, strlen(s), width, 0);
+	size_t len;
+
+	assert(s);
+
+	len = strlen(s);
+	/* mbsnbytes() gives the width itself in single byte locales */
+	if(MB_CUR_MAX > 1 && is_printable_ascii(s, len))
+		return (width <= 0) ? 0 : min((size_t)width, len);
+
+	return mbsnbytes(s, len, width, 0);
 #else
+	assert(s);
 	return width;
 #endif
 }
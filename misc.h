@@ -28,6 +28,72 @@ char		*my_getcwd();
 
 char		*getaline(FILE *f);
 
+/*
+ * Reads lines out of large fread() blocks. A line returned by
+ * line_reader_read() lives in the reader's buffer: it may be modified,
+ * and stays valid until the next call.
+ */
+struct line_reader {
+	FILE *f;
+	char *buf;
+	size_t size;
+	size_t pos;		/* start of the unread data */
+	size_t end;		/* end of the data in buf */
+	size_t scanned;		/* data known to hold no newline */
+	int f_eof;		/* nothing left to fread() */
+	int eof;		/* what feof() would say after getaline() */
+	size_t last_pos;	/* state before the last line, for unread */
+	int last_eof;
+	int last_nl;
+	off_t base;		/* offset of buf in the file */
+};
+
+void		line_reader_init(struct line_reader *r, FILE *f);
+char		*line_reader_read(struct line_reader *r);
+void		line_reader_unread(struct line_reader *r);
+#define		line_reader_eof(r)	((r)->eof)
+/* offset in the file of the next line */
+#define		line_reader_tell(r)	((r)->base + (off_t)(r)->pos)
+void		line_reader_free(struct line_reader *r);
+
+/*
+ * Collects output text in memory. A buffer writing to a file is flushed
+ * whenever it is full, one without a file grows as needed.
+ */
+#define OUTBUF_BLOCK	65536
+
+struct outbuf {
+	FILE *f;
+	char *data;
+	size_t len;
+	size_t size;
+	int own;	/* data was allocated here */
+	int err;
+	off_t written;	/* to f so far */
+};
+
+void		outbuf_init(struct outbuf *b, FILE *f, char *space, size_t size);
+void		outbuf_add(struct outbuf *b, const char *s, size_t len);
+#define		outbuf_literal(b, s)	outbuf_add(b, s, sizeof(s) - 1)
+/* number of bytes added so far */
+#define		outbuf_tell(b)		((b)->written + (off_t)(b)->len)
+void		outbuf_puts(struct outbuf *b, const char *s);
+void		outbuf_putc(struct outbuf *b, int c);
+void		outbuf_escaped(struct outbuf *b, const char *s, size_t len,
+		const char *(*escape)(int c));
+void		outbuf_int(struct outbuf *b, int n);
+int		outbuf_flush(struct outbuf *b);
+void		outbuf_free(struct outbuf *b);
+
+/*
+ * 64 bit hash, fed piece by piece starting from HASH_INIT
+ */
+#define HASH_INIT	0xcbf29ce484222325ULL
+
+unsigned long long	hash_add(unsigned long long h, const void *p,
+		size_t len);
+#define		hash_str(h, s)	hash_add(h, s, strlen(s) + 1)
+
 int		strwidth(const char *s);
 int		bytes2width(const char *s, int width);
 
@@ -68,6 +68,7 @@ static struct option abook_vars[] = {
 	{ "use_mouse", OT_BOOL, BOOL_USE_MOUSE, FALSE },
 	{ "scroll_speed", OT_INT, INT_SCROLL_SPEED, UL 2 },
 	{ "use_colors", OT_BOOL, BOOL_USE_COLORS, FALSE },
+	{ "export_cache", OT_BOOL, BOOL_EXPORT_CACHE, FALSE },
 	{ "color_header_fg", OT_STR, STR_COLOR_HEADER_FG, UL "blue" },
 	{ "color_header_fg", OT_STR, STR_COLOR_HEADER_FG, UL "blue" },
 	{ "color_header_bg", OT_STR, STR_COLOR_HEADER_BG, UL "red" },
@@ -189,6 +190,20 @@ free_opts()
 	}
 }
 
+/* adds the current values of all options to the hash h */
+unsigned long long
+opt_hash(unsigned long long h)
+{
+	int i;
+
+	h = hash_add(h, bool_opts, sizeof(bool_opts));
+	h = hash_add(h, int_opts, sizeof(int_opts));
+	for(i = 0; i < STR_MAX; i++)
+		h = hash_str(h, safe_str(str_opts[i]));
+
+	return h;
+}
+
 /*
  * file parsing
  */
@@ -284,12 +299,15 @@ get_token(buffer *b, int options)
 		return NULL; /* no error, just end of parsing */
 	}
 
+	c = *b->ptr;
+
 	if(options & TOKEN_ALLOC) /* freeing is the caller's responsibility */
 		b->data = xstrndup(b->data, end - b->data);
 	else
 		*end = 0;
 
-	b->ptr++; /* advance to next token */
+	if(c) /* advance to next token, not past the end of the line */
+		b->ptr++;
 	SKIPWS(b->ptr);
 
 	return NULL;
@@ -521,17 +539,20 @@ int
 load_opts(char *filename)
 {
 	FILE *in;
-	char *line = NULL;
+	struct line_reader r;
+	char *line;
 	int n;
 	int err = 0;
 
 	if((in = fopen(filename, "r")) == NULL)
 		return -1;
 
-	for(n = 1;!feof(in); n++) {
-		line = getaline(in);
+	line_reader_init(&r, in);
 
-		if(feof(in))
+	for(n = 1;!line_reader_eof(&r); n++) {
+		line = line_reader_read(&r);
+
+		if(line_reader_eof(&r))
 			break;
 
 		if(line && *line) {
@@ -539,12 +560,10 @@ load_opts(char *filename)
 			if(*line)
 				err += opt_parse_line(line, n, filename) ? 1:0;
 		}
-
-		free(line);
-		line = NULL;
 	}
 
-	free(line);
+	line_reader_free(&r);
+	fclose(in);
 
 	/* post-initialization */
 	err += check_options();
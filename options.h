@@ -28,6 +28,7 @@ enum bool_opts {
 	BOOL_SHOW_CURSOR,
 	BOOL_USE_COLORS,
 	BOOL_USE_MOUSE,
+	BOOL_EXPORT_CACHE,
 	BOOL_MAX
 };
 
@@ -86,5 +87,6 @@ char *		opt_get_str(enum str_opts opt);
 void		init_opts();
 void		free_opts();
 int		load_opts(char *filename);
+unsigned long long	opt_hash(unsigned long long h);
 
 #endif
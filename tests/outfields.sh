@@ -0,0 +1,44 @@
+#!/bin/sh
+#
+# --outfields without "name": the output formats which identify an entry
+# by its name must still get it
+#
+
+ABOOK=${ABOOK:-./abook}
+dir=${TMPDIR:-/tmp}/abook-outfields.$$
+
+mkdir "$dir" || exit 1
+trap 'rm -rf "$dir"' 0
+
+HOME=$dir
+export HOME
+
+printf 'John Doe,john@example.org\n' > "$dir/in.csv"
+
+status=0
+
+for format in ldif vcard mutt text html pine palmcsv elm allcsv; do
+	if ! $ABOOK --convert --informat csv --infile "$dir/in.csv" \
+			--outformat $format --outfields email \
+			> "$dir/out.$format" 2>&1; then
+		echo "FAIL: --outformat $format --outfields email"
+		status=1
+	fi
+done
+
+grep -q '^dn: cn=John Doe,mail=john@example.org' "$dir/out.ldif" || {
+	echo "FAIL: ldif without the name"
+	status=1
+}
+
+grep -q '^FN:John Doe' "$dir/out.vcard" || {
+	echo "FAIL: vcard without the name"
+	status=1
+}
+
+grep -q 'John Doe' "$dir/out.allcsv" && {
+	echo "FAIL: allcsv with the name"
+	status=1
+}
+
+exit $status
@@ -54,6 +54,7 @@ static bool should_resize = FALSE;
 static bool can_resize = FALSE;
 static struct timeval last_click_time;
 static int double_click_interval = 200; /* maximum time in milliseconds */
+static int save_poll_interval = 100; /* milliseconds */
 
 static WINDOW *top = NULL, *bottom = NULL;
 
@@ -395,8 +396,10 @@ statusline_askchoice(const char *msg, const char *choices, short dflt)
 	}
 }
 
-char *
-ui_readline(const char *prompt, char *s, size_t limit, bool use_completion)
+static char *
+ui_readline_real(const char *prompt, char *s, size_t limit,
+		bool use_completion, int complete_fields[],
+		void (*hook)(char *line))
 {
 	int y, x;
 	char *ret;
@@ -405,7 +408,11 @@ ui_readline(const char *prompt, char *s, size_t limit, bool use_completion)
 
 	getyx(bottom, y, x);
 
-	ret = abook_readline(bottom, y, x, s, use_completion);
+	if(complete_fields || hook)
+		ret = abook_readline_hook(bottom, y, x, s, complete_fields,
+				hook);
+	else
+		ret = abook_readline(bottom, y, x, s, use_completion);
 
 	if(ret) {
 		strtrim(ret);
@@ -416,6 +423,21 @@ ui_readline(const char *prompt, char *s, size_t limit, bool use_completion)
 	return ret;
 }
 
+char *
+ui_readline(const char *prompt, char *s, size_t limit, bool use_completion)
+{
+	return ui_readline_real(prompt, s, limit, use_completion, NULL, NULL);
+}
+
+/* like ui_readline(), completing with the values of complete_fields */
+char *
+ui_readline_fields(const char *prompt, char *s, size_t limit,
+		int complete_fields[])
+{
+	return ui_readline_real(prompt, s, limit, FALSE, complete_fields,
+			NULL);
+}
+
 int
 statusline_ask_boolean(const char *msg, int def)
 {
@@ -523,8 +545,6 @@ display_help(int help)
  * end of help
  */
 
-extern char *selected;
-
 void
 get_commands()
 {
@@ -536,10 +556,16 @@ get_commands()
 			hide_cursor();
 		if(should_resize)
 			refresh_screen();
+		/* wakes up to report the end of a save */
+		timeout(ui_save_poll() ? save_poll_interval : -1);
 		ch = getch();
+		timeout(-1);
 		if(!opt_get_bool(BOOL_SHOW_CURSOR))
 			show_cursor();
 		can_resize = FALSE; /* it's not safe to resize anymore */
+		if(ch == ERR)
+			continue;
+		db_journal_step(); /* each command is undone on its own */
 		if(ch == KEY_MOUSE) {
 			MEVENT event;
 			bool double_clicked = was_double_click();
@@ -549,7 +575,8 @@ get_commands()
 					if(event.y == 0) {
 						return;
 					}
-					list_set_curitem(event.y + list_get_firstitem() - LIST_TOP);
+					list_set_curitem(list_item_at(event.y +
+						list_get_firstitem() - LIST_TOP));
 					if(double_clicked) {
 						edit_item(-1);
 					} else {
@@ -580,6 +607,8 @@ get_commands()
 			case 'M': ui_merge_items();	break;
 			case 'D': duplicate_item();	break;
 			case 'U': ui_remove_duplicates(); break;
+			case 'u': ui_undo(FALSE);	break;
+			case 18 : ui_undo(TRUE);	break; /* ^R */
 			case 12: refresh_screen();	break;
 
 			case 'k':
@@ -596,8 +625,7 @@ get_commands()
 			case 'G':
 			case KEY_END: goto_end();	break;
 
-			case 'w': save_database(0); // we may reconsider force_save = 1
-				  break;
+			case 'w': ui_save_database();	break;
 			case 'l': ui_read_database();	break;
 			case 'i': import_database();	break;
 			case 'e': export_database();	break;
@@ -612,6 +640,7 @@ get_commands()
 			case '/': ui_find(0);		break;
 			case 'n':
 			case '\\': ui_find(1);		break;
+			case 'L': ui_limit();		break;
 
 			case ' ': if(list_get_curitem() >= 0) {
 				   list_invert_curitem_selection();
@@ -680,6 +709,51 @@ ui_remove_duplicates()
 	refresh_list();
 }
 
+void
+ui_undo(int redo)
+{
+	int item;
+
+	if(!(redo ? db_redo(&item) : db_undo(&item))) {
+		statusline_addstr(redo ? _("Nothing to redo") :
+				_("Nothing to undo"));
+		return;
+	}
+
+	if(item >= 0)
+		list_set_curitem(item);
+	else if(list_get_curitem() > last_item())
+		list_set_curitem(last_item());
+
+	ui_print_number_of_items();
+	refresh_list();
+}
+
+void
+ui_save_database()
+{
+	clear_statusline();
+	statusline_addstr(_("Saving..."));
+	save_database_background();
+}
+
+/* reports the end of a background save, returns TRUE while it runs */
+int
+ui_save_poll()
+{
+	int ret = save_database_finish(FALSE);
+
+	if(ret == 1 || ret == 2)
+		return ret == 1;
+
+	ui_print_number_of_items();
+	clear_statusline();
+	statusline_addstr(ret ? _("Could not save the database") :
+			_("Database saved"));
+
+	return FALSE;
+}
+
 void
 ui_clear_database()
 {
@@ -690,12 +764,45 @@ ui_clear_database()
 	}
 }
 
+static int search_fields[] = {NAME, EMAIL, NICK, -1};
+static int find_start;
+
+/* moves to the first match of the search typed so far */
+static void
+ui_find_update(char *line)
+{
+	char *s = strtrim(xstrdup(line));
+	int item = find_start;
+
+	if(*s && (item = find_item_incremental(s, find_start,
+					search_fields)) < 0)
+		item = find_start;
+	free(s);
+
+	if(item != list_get_curitem()) {
+		list_set_curitem(item);
+		refresh_list();
+	}
+}
+
+/* find_item() for the items the list shows */
+static int
+find_shown_item(char *str, int start)
+{
+	int item;
+
+	while((item = find_item(str, start, search_fields)) >= 0 &&
+			!list_item_shown(item))
+		start = item + 1;
+
+	return item;
+}
+
 void
 ui_find(int next)
 {
 	int item = -1;
 	static char findstr[MAX_FIELD_LEN];
-	int search_fields[] = {NAME, EMAIL, NICK, -1};
 
 	clear_statusline();
 
@@ -704,7 +811,13 @@ ui_find(int next)
 			return;
 	} else {
 		char *s;
-		s = ui_readline("/", findstr, MAX_FIELD_LEN - 1, 0);
+		find_start = list_get_curitem();
+		s = ui_readline_real("/", findstr, MAX_FIELD_LEN - 1, FALSE,
+				search_fields,
+				list_is_empty() ? NULL : ui_find_update);
+		find_item_incremental_end();
+		/* the search below decides where to go */
+		list_set_curitem(find_start);
 		refresh_screen();
 		if(s == NULL) {
 			return; /* user cancelled (ctrl-G) */
@@ -714,9 +827,8 @@ ui_find(int next)
 		}
 	}
 
-	if( (item = find_item(findstr, list_get_curitem() + !!next,
-			search_fields)) < 0 &&
-			(item = find_item(findstr, 0, search_fields)) >= 0)
+	if( (item = find_shown_item(findstr, list_get_curitem() + !!next)) < 0 &&
+			(item = find_shown_item(findstr, 0)) >= 0)
 		statusline_addstr(_("Search hit bottom, continuing at top"));
 
 	if(item >= 0) {
@@ -725,16 +837,64 @@ ui_find(int next)
 	}
 }
 
+/* shows the items matching the limit typed so far */
+static void
+ui_limit_update(char *line)
+{
+	char *s = strtrim(xstrdup(line));
+	int *items = NULL, n = 0;
+
+	if(*s)
+		n = find_items_incremental(s, search_fields, &items);
+	free(s);
+
+	list_limit_preview(items, n);
+	refresh_list();
+	refresh(); /* the number of items */
+}
+
+void
+ui_limit()
+{
+	char *s, *old = list_get_limit() ? xstrdup(list_get_limit()) : NULL;
+
+	clear_statusline();
+
+	s = ui_readline_real(_("Limit to: "), old, MAX_FIELD_LEN - 1, FALSE,
+			search_fields, ui_limit_update);
+	/* cancelling keeps the old limit */
+	list_limit(s ? s : old, search_fields);
+	find_item_incremental_end();
+
+	xfree(s);
+	xfree(old);
+
+	refresh_screen();
+}
+
 void
 ui_print_number_of_items()
 {
-	char *str = strdup_printf("    %c" "|%3d/%3d",
+	static int width = 0;
+	char *str;
+
+	if(list_shown_items() < db_n_items())
+		str = strdup_printf("    %c" "|%3d/%3d of %d",
 				  db_need_save ? '*' : ' ',
 				  selected_items(),
+				  list_shown_items(),
 				  db_n_items());
+	else
+		str = strdup_printf("    %c" "|%3d/%3d",
+				  db_need_save ? '*' : ' ',
+				  selected_items(),
+				  db_n_items());
+
+	/* covers what a longer number took before */
+	width = max(width, (int)strlen(str));
 
 	attrset(COLOR_PAIR(CP_HEADER));
-	mvaddstr(0, COLS-strlen(str), str);
+	mvprintw(0, COLS - width, "%*s", width, str);
 
 	free(str);
 }
@@ -772,7 +932,7 @@ ui_print_database()
 
 	switch(statusline_askchoice(_("Print <a>ll, print <s>elected, or <c>ancel?"), S_("keybindings:all/selected/cancel|asc"), 3)) {
 		case 1:
-			mode = ENUM_ALL;
+			mode = ENUM_SHOWN;
 			break;
 		case 2:
 			if( !selected_items() ) {
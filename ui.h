@@ -26,13 +26,19 @@ void		display_help(int help);
 void		statusline_addstr(const char *str);
 char *		ui_readline(const char *prompt, char *s, size_t limit,
 			bool use_completion);
+char *		ui_readline_fields(const char *prompt, char *s, size_t limit,
+			int complete_fields[]);
 void		refresh_statusline();
 void		get_commands();
 void		ui_remove_items();
 void		ui_merge_items();
 void		ui_remove_duplicates();
+void		ui_undo(int redo);
+void		ui_save_database();
+int		ui_save_poll();
 void		ui_clear_database();
 void		ui_find(int next);
+void		ui_limit();
 void		ui_print_number_of_items();
 void		ui_read_database();
 char		*get_surname(char *s);
@@ -163,8 +163,7 @@ int vcard_parse_file_libvformat(char *filename) {
 	    abook_list_free(&multivalues);
     }
 
-    add_item2database(item);
-    item_free(&item);
+    db_adopt_item(item);
   } while (vf_get_next_object(&vfobj));
 
   return 0;